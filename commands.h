@@ -1,6 +1,8 @@
 #ifndef __COMMANDS_H__
 #define __COMMANDS_H__
 
+#include <stdint.h>
+
 enum Command {
 	CommandShow,
 	CommandHide,
@@ -8,6 +10,75 @@ enum Command {
 	CommandSetTop,
 	CommandSetBot,
 	CommandToggleLoc,
+	CommandSubscribe,
+	/* the output name, a space and the status text */
+	CommandStatus,
+	/* the output name, a space and the title text */
+	CommandTitle,
 };
 
+/*
+ * Besides newline-terminated text commands, a Command byte followed by the
+ * output name, the control socket takes binary frames. A frame is a
+ * FrameHeader followed by length bytes of payload. Its first byte is
+ * FRAME_MAGIC, which no Command is. Both ends share a machine, so
+ * everything is in host byte order.
+ *
+ * Every query is answered with a frame of the same opcode with
+ * OPCODE_REPLY set. A frame dwlb cannot handle, including one of another
+ * version, is answered with OpcodeError.
+ */
+#define FRAME_MAGIC (0xdb)
+#define FRAME_VERSION (1)
+#define FRAME_PAYLOAD_MAX (4096)
+#define OPCODE_REPLY (0x8000)
+
+enum Opcode {
+	/* any number of BatchEntry, each followed by its output name;
+	 * not answered */
+	OpcodeBatch,
+	/* answered with a BarState per bar, each followed by its output name
+	 * and window title */
+	OpcodeQueryBars,
+	/* answered with a StatsState */
+	OpcodeQueryStats,
+	/* answered with a RenderTimings */
+	OpcodeQueryTimings,
+	OpcodeError,
+};
+
+typedef struct {
+	uint8_t magic;
+	uint8_t version;
+	uint16_t opcode;
+	uint32_t length;
+} FrameHeader;
+
+typedef struct {
+	uint8_t command;
+	uint8_t pad;
+	uint16_t length;
+} BatchEntry;
+
+typedef struct {
+	uint32_t mtags, ctags, urg;
+	uint32_t layout_idx;
+	uint8_t sel, hidden, bottom, fullscreen;
+	uint16_t name_length, title_length;
+} BarState;
+
+typedef struct {
+	uint8_t cpu_usage, mem_usage, gpu_temperature;
+	uint8_t playback_volume, capture_volume;
+	uint8_t pad[3];
+	uint64_t disk_read, disk_written;
+	uint64_t net_rx, net_tx;
+} StatsState;
+
+/* time spent drawing the bars, in nanoseconds */
+typedef struct {
+	uint64_t frames;
+	uint64_t total, max, last;
+} RenderTimings;
+
 #endif // __COMMANDS_H__
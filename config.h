@@ -20,6 +20,19 @@ DECLARE_COLOR(middle_sel, HEX_COLOR(0x040810ff), HEX_COLOR(0x417ebaee));
 // this is what we will read in /sys/class/net to collect network data
 #define NET_INTERFACE_NAME "enp10s0"
 
+// block devices from /proc/diskstats to sum up for disk I/O, NULL-terminated.
+// When empty, every whole disk not matching a disk_ignore prefix is used.
+static const char * const disk_devices[] = { NULL };
+static const char * const disk_ignore[] = { "loop", "ram", "zram", "dm-", "md", "sr", NULL };
+
+// seconds between two samples of each statistic, all on whole-second
+// boundaries so they share wakeups; the clock always ticks every second
+static const uint32_t cpu_period  = 1;
+static const uint32_t mem_period  = 1;
+static const uint32_t disk_period = 2;
+static const uint32_t net_period  = 2;
+static const uint32_t gpu_period  = 5;
+
 // font
 #define FONTCOUNT (2)
 static const char *fontstr[FONTCOUNT] = {
@@ -31,11 +44,20 @@ static const char * const bar_time_fmt = "%02d:%02d:%02d";
 static const char * const bar_state_fmt = "󰛶%4s 󰛴%4s | 󱘾%4s 󱘻%4s | %3d°C | %3d%% | %3d%% |";
 static const char * const bar_date_fmt = "%02d-%02d-%04d";
 
+// Scrolling over the volume or microphone field changes it by volume_step
+// percent per notch, right through the mixer dwlb already has open. Without
+// volume_in_process, each notch runs one of the commands below instead.
+static const bool volume_in_process = true;
+static const int32_t volume_step = 1;
 static const char* const vol_up_cmd =   "amixer -q set Master 1%+";
 static const char* const vol_down_cmd = "amixer -q set Master 1%-";
 static const char* const mic_up_cmd =   "amixer -q set Capture 1%+";
 static const char* const mic_down_cmd = "amixer -q set Capture 1%-" ;
 
+// milliseconds within which running the same command again is skipped,
+// 0 to run every command each time
+static const uint32_t command_interval = 0;
+
 // tags
 #define TAGCOUNT (9)
 static const char tags[TAGCOUNT * 2] = { "1\0002\0003\0004\0005\0006\0007\0008\0009\000" };
@@ -50,6 +72,18 @@ static const bool hidden = false;
 static const bool bottom = false;
 // hide vacant tags
 static const bool hide_vacant = false;
+// interpret in-line commands like ^fg() in status and title text, rather
+// than showing them as they are
+static const bool status_commands = true;
+// render the clock, stats, date and volume once and copy them into every bar
+static const bool shared_fields = true;
+// show the clock, stats and volume on subsurfaces of their own, so their
+// updates do not commit the whole bar
+static const bool widget_subsurfaces = false;
+// draw the empty middle of the bar as one stretched pixel, so that only the
+// parts with text need shared memory; needs wp_single_pixel_buffer_manager_v1
+// and wp_viewporter, and implies widget_subsurfaces
+static const bool flat_background = false;
 // vertical pixel padding above and below text
 static const uint32_t vertical_padding = 0;
 // scale
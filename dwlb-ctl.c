@@ -1,10 +1,16 @@
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -13,8 +19,37 @@
 #define PROGRAM "dwlb-ctl"
 #define VERSION "0.1"
 
+#define LENGTH(X) (sizeof X / sizeof X[0])
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* dwlb takes at most this many socket names */
+#define INSTANCES_MAX (50)
+
+typedef struct {
+	int fd;
+	char path[sizeof ((struct sockaddr_un *)0)->sun_path];
+} Instance;
+
 static char socketdir[256];
-static char sockbuf[256];
+static char sockbuf[FRAME_PAYLOAD_MAX];
+
+/* the commands accepted on stdin by -stream, named like the options */
+static const struct {
+	const char *name;
+	enum Command cmd;
+} commands[] = {
+	{ "-show",              CommandShow },
+	{ "-hide",              CommandHide },
+	{ "-toggle-visibility", CommandToggleVis },
+	{ "-set-top",           CommandSetTop },
+	{ "-set-bottom",        CommandSetBot },
+	{ "-toggle-location",   CommandToggleLoc },
+	{ "-status",            CommandStatus },
+	{ "-title",             CommandTitle },
+};
+
+static Instance instances[INSTANCES_MAX];
+static size_t instance_count;
 
 static const char * const usage =
 	"usage: dwlb-ctl <Command>\n"
@@ -27,6 +62,17 @@ static const char * const usage =
 	"    -set-top           <OUTPUT>       draw bar at the top\n"
 	"    -set-bottom        <OUTPUT>       draw bar at the bottom\n"
 	"    -toggle-location   <OUTPUT>       toggle bar location\n"
+	"    -status            <OUTPUT> <TEXT> set status text\n"
+	"    -title             <OUTPUT> <TEXT> set title text, in place of the\n"
+	"                                      window title\n"
+	"    -subscribe         <OUTPUT>       print a line whenever the tags, selection,\n"
+	"                                      layout or title of a bar change\n"
+	"    -query             <WHAT>         print the state of every bar ('bars'), the\n"
+	"                                      last statistics ('stats') or the time\n"
+	"                                      spent drawing ('timings')\n"
+	"    -stream                           read commands from stdin, one per line,\n"
+	"                                      like '-show all', and send them over one\n"
+	"                                      connection to each running instance\n"
 	"\n"
 	"  For every command, [OUTPUT] 'all' will apply the command on all outputs,\n"
 	"  while 'selected' will apply to the current select output.\n"
@@ -67,7 +113,8 @@ client_send_command(struct sockaddr_un *sock_address, const char *output,
 	if (!(dir = opendir(socketdir)))
 		die("Could not open directory '%s':", socketdir);
 
-	len = snprintf(sockbuf, sizeof(sockbuf), "%c%s", cmd, output);
+	if ((len = snprintf(sockbuf, sizeof(sockbuf), "%c%s\n", cmd, output)) >= sizeof sockbuf)
+		die("Text too long");
 
 	/* Send data to all dwlb instances */
 	newfd = true;
@@ -76,7 +123,13 @@ client_send_command(struct sockaddr_un *sock_address, const char *output,
 			if (!target_socket || !strncmp(de -> d_name, target_socket, 6)){
 				if (newfd && (sock_fd = socket(AF_UNIX, SOCK_STREAM, 1)) == -1)
 					die("socket:");
-				snprintf(sock_address->sun_path, sizeof sock_address->sun_path, "%s/%s", socketdir, de->d_name);
+				/* a truncated path would name some other socket */
+				if (snprintf(sock_address->sun_path, sizeof sock_address->sun_path, "%s/%s",
+						socketdir, de->d_name) >= (int)sizeof sock_address->sun_path) {
+					fprintf(stderr, "Socket path '%s/%s' too long\n", socketdir, de->d_name);
+					newfd = false;
+					continue;
+				}
 				if (connect(sock_fd, (struct sockaddr *) sock_address, sizeof(*sock_address)) == -1) {
 					newfd = false;
 					continue;
@@ -92,6 +145,290 @@ client_send_command(struct sockaddr_un *sock_address, const char *output,
 	closedir(dir);
 }
 
+void
+client_connect_all(struct sockaddr_un *sock_address, const char *target_socket)
+{
+	int sock_fd;
+	DIR *dir;
+	struct dirent *de;
+
+	if (!(dir = opendir(socketdir)))
+		die("Could not open directory '%s':", socketdir);
+
+	while ((de = readdir(dir)) && instance_count < LENGTH(instances)) {
+		if (strncmp(de->d_name, "dwlb-", 5))
+			continue;
+		if (target_socket && strncmp(de->d_name, target_socket, 6))
+			continue;
+		if (snprintf(sock_address->sun_path, sizeof sock_address->sun_path, "%s/%s",
+				socketdir, de->d_name) >= (int)sizeof sock_address->sun_path) {
+			fprintf(stderr, "Socket path '%s/%s' too long\n", socketdir, de->d_name);
+			continue;
+		}
+		if ((sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 1)) == -1)
+			die("socket:");
+		if (connect(sock_fd, (struct sockaddr *) sock_address, sizeof(*sock_address)) == -1) {
+			close(sock_fd);
+			continue;
+		}
+		instances[instance_count].fd = sock_fd;
+		snprintf(instances[instance_count].path, sizeof instances[instance_count].path, "%s", sock_address->sun_path);
+		++instance_count;
+	}
+
+	closedir(dir);
+	if (!instance_count)
+		die("Could not connect to any dwlb instance");
+}
+
+void
+client_flush(struct iovec *iov, int count)
+{
+	struct iovec vec[count];
+	ssize_t len;
+	int i, n;
+
+	/* one writev per instance for everything read from stdin at once;
+	 * instances that went away are dropped */
+	for (size_t j = 0; j < instance_count; ++j) {
+		memcpy(vec, iov, sizeof vec);
+		for (i = 0, n = count; n;) {
+			if ((len = writev(instances[j].fd, &vec[i], n)) == -1) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Could not send status data to '%s'\n", instances[j].path);
+				close(instances[j].fd);
+				instances[j--] = instances[--instance_count];
+				break;
+			}
+			for (; n && (size_t)len >= vec[i].iov_len; --n)
+				len -= vec[i++].iov_len;
+			if (n) {
+				vec[i].iov_base = (char *)vec[i].iov_base + len;
+				vec[i].iov_len -= len;
+			}
+		}
+	}
+	if (!instance_count)
+		die("No dwlb instance left to send to");
+}
+
+bool
+client_recv_all(int fd, void *data, size_t len)
+{
+	ssize_t n;
+
+	for (char *p = data; len; p += n, len -= n) {
+		if ((n = recv(fd, p, len, 0)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+client_query(struct sockaddr_un *sock_address, const char *what, const char *target_socket)
+{
+	FrameHeader header = { .magic = FRAME_MAGIC, .version = FRAME_VERSION }, reply;
+	char payload[16384], name[256], title[1024];
+	BarState bar;
+	StatsState stats;
+	RenderTimings timings;
+	size_t i, off;
+
+	if (!strcmp(what, "bars"))
+		header.opcode = OpcodeQueryBars;
+	else if (!strcmp(what, "stats"))
+		header.opcode = OpcodeQueryStats;
+	else if (!strcmp(what, "timings"))
+		header.opcode = OpcodeQueryTimings;
+	else
+		die("Query '%s' not recognized\n%s", what, usage);
+
+	client_connect_all(sock_address, target_socket);
+	for (i = 0; i < instance_count; ++i) {
+		if (send(instances[i].fd, &header, sizeof header, 0) == -1
+		    || !client_recv_all(instances[i].fd, &reply, sizeof reply)
+		    || reply.length > sizeof payload
+		    || !client_recv_all(instances[i].fd, payload, reply.length))
+			die("Could not query '%s'", instances[i].path);
+		if (reply.opcode != (header.opcode | OPCODE_REPLY))
+			die("'%s' does not understand this query", instances[i].path);
+
+		if (instance_count > 1)
+			printf("%s\n", instances[i].path);
+		switch (header.opcode) {
+		case OpcodeQueryBars:
+			for (off = 0; off + sizeof bar <= reply.length;) {
+				memcpy(&bar, payload + off, sizeof bar);
+				off += sizeof bar;
+				if (off + bar.name_length + bar.title_length > reply.length)
+					break;
+				snprintf(name, sizeof name, "%.*s", bar.name_length, payload + off);
+				off += bar.name_length;
+				snprintf(title, sizeof title, "%.*s", bar.title_length, payload + off);
+				off += bar.title_length;
+				printf("%s tags %u %u %u sel %u layout %u hidden %u bottom %u fullscreen %u title %s\n",
+				       name, bar.mtags, bar.ctags, bar.urg, bar.sel, bar.layout_idx,
+				       bar.hidden, bar.bottom, bar.fullscreen, title);
+			}
+			break;
+		case OpcodeQueryStats:
+			if (reply.length < sizeof stats)
+				break;
+			memcpy(&stats, payload, sizeof stats);
+			printf("cpu %u mem %u gpu %u disk %lu %lu net %lu %lu volume %u %u\n",
+			       stats.cpu_usage, stats.mem_usage, stats.gpu_temperature,
+			       (unsigned long)stats.disk_read, (unsigned long)stats.disk_written,
+			       (unsigned long)stats.net_rx, (unsigned long)stats.net_tx,
+			       stats.playback_volume, stats.capture_volume);
+			break;
+		case OpcodeQueryTimings:
+			if (reply.length < sizeof timings)
+				break;
+			memcpy(&timings, payload, sizeof timings);
+			printf("frames %lu mean %lu max %lu last %lu ns\n",
+			       (unsigned long)timings.frames,
+			       (unsigned long)(timings.frames ? timings.total / timings.frames : 0),
+			       (unsigned long)timings.max, (unsigned long)timings.last);
+			break;
+		}
+		close(instances[i].fd);
+	}
+}
+
+void
+client_stream(struct sockaddr_un *sock_address, const char *target_socket)
+{
+	char in[4096], out[FRAME_PAYLOAD_MAX];
+	FrameHeader header = { .magic = FRAME_MAGIC, .version = FRAME_VERSION, .opcode = OpcodeBatch };
+	struct iovec iov[2] = { { &header, sizeof header }, { out, 0 } };
+	BatchEntry entry;
+	char *start, *end, *nl, *name, *output;
+	size_t pending = 0, i;
+	ssize_t len;
+
+	/* a closed instance shows up as a failed write instead */
+	signal(SIGPIPE, SIG_IGN);
+	client_connect_all(sock_address, target_socket);
+
+	while ((len = read(STDIN_FILENO, in + pending, sizeof in - pending)) != 0) {
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			die("read:");
+		}
+
+		/* Every complete line becomes an entry of a batch, so that
+		 * everything read at once goes out in as few frames as fit */
+		start = in;
+		end = in + pending + len;
+		header.length = 0;
+		while ((nl = memchr(start, '\n', end - start))) {
+			*nl = '\0';
+			name = start;
+			start = nl + 1;
+			if (!(output = strpbrk(name, " \t")))
+				continue;
+			*output++ = '\0';
+			output += strspn(output, " \t");
+			for (char *e = output + strlen(output); e > output && strchr(" \t\r", e[-1]); )
+				*--e = '\0';
+			for (i = 0; i < LENGTH(commands); ++i)
+				if (!strcmp(name, commands[i].name))
+					break;
+			if (i == LENGTH(commands) || !*output) {
+				fprintf(stderr, "Command '%s' not recognized\n", name);
+				continue;
+			}
+
+			entry.command = commands[i].cmd;
+			for (char *c = output; *c; ++c)
+				if ((unsigned char)*c < ' ' || *c == 0x7f)
+					*c = ' ';
+			entry.length = MIN(strlen(output), UINT16_MAX);
+			if (sizeof entry + entry.length > sizeof out) {
+				fprintf(stderr, "Text of '%s' too long\n", name);
+				continue;
+			}
+			if (header.length + sizeof entry + entry.length > sizeof out) {
+				iov[1].iov_len = header.length;
+				client_flush(iov, LENGTH(iov));
+				header.length = 0;
+			}
+			memcpy(out + header.length, &entry, sizeof entry);
+			memcpy(out + header.length + sizeof entry, output, entry.length);
+			header.length += sizeof entry + entry.length;
+		}
+		if (header.length) {
+			iov[1].iov_len = header.length;
+			client_flush(iov, LENGTH(iov));
+		}
+
+		pending = end - start;
+		memmove(in, start, pending);
+		if (pending == sizeof in)
+			die("Line too long");
+	}
+
+	for (i = 0; i < instance_count; ++i)
+		close(instances[i].fd);
+}
+
+void
+client_subscribe(struct sockaddr_un *sock_address, const char *output, const char *target_socket)
+{
+	struct pollfd fds[INSTANCES_MAX];
+	char buf[INSTANCES_MAX][1024];
+	size_t pending[INSTANCES_MAX] = { 0 };
+	char *nl;
+	ssize_t len;
+	size_t i, j;
+
+	signal(SIGPIPE, SIG_IGN);
+	client_connect_all(sock_address, target_socket);
+	len = snprintf(sockbuf, sizeof(sockbuf), "%c%s\n", CommandSubscribe, output);
+	for (i = 0; i < instance_count; ++i) {
+		if (send(instances[i].fd, sockbuf, len, 0) == -1)
+			die("Could not subscribe to '%s':", instances[i].path);
+		fds[i] = (struct pollfd) { .fd = instances[i].fd, .events = POLLIN };
+	}
+
+	/* Print whole lines only, so that the events of several instances do
+	 * not run into each other. */
+	for (j = instance_count; j;) {
+		if (poll(fds, instance_count, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		for (i = 0; i < instance_count; ++i) {
+			if (!fds[i].revents)
+				continue;
+			len = recv(fds[i].fd, buf[i] + pending[i], sizeof buf[i] - pending[i], 0);
+			if (len <= 0) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				--j;
+				continue;
+			}
+			pending[i] += len;
+			if ((nl = memrchr(buf[i], '\n', pending[i]))) {
+				fwrite(buf[i], 1, nl + 1 - buf[i], stdout);
+				fflush(stdout);
+				pending[i] -= nl + 1 - buf[i];
+				memmove(buf[i], nl + 1, pending[i]);
+			} else if (pending[i] == sizeof buf[i]) {
+				pending[i] = 0;
+			}
+		}
+	}
+}
+
 int
 main(int argc, char **argv)
 {
@@ -99,6 +436,7 @@ main(int argc, char **argv)
 		die("ERROR: missing command\n%s", usage);
 	}
 	char *xdgruntimedir;
+	char text[FRAME_PAYLOAD_MAX];
 	struct sockaddr_un sock_address;
 
 	/* Establish socket directory */
@@ -146,6 +484,28 @@ main(int argc, char **argv)
 		if (++i >= argc)
 			die("Option -toggle-location requires an argument");
 		client_send_command(&sock_address, argv[i], CommandToggleLoc, target_socket);
+	} else if (!strcmp(argv[i], "-status") || !strcmp(argv[i], "-title")) {
+		const enum Command cmd = !strcmp(argv[i], "-status") ? CommandStatus : CommandTitle;
+		if (i + 2 >= argc)
+			die("Option %s requires two arguments", argv[i]);
+		if (snprintf(text, sizeof text, "%s %s", argv[i + 1], argv[i + 2]) >= (int)sizeof text)
+			die("Text too long");
+		/* commands are sent one per line, so the text has to stay on
+		 * one; output of several lines becomes one line */
+		for (char *c = text; *c; ++c)
+			if ((unsigned char)*c < ' ' || *c == 0x7f)
+				*c = ' ';
+		client_send_command(&sock_address, text, cmd, target_socket);
+	} else if (!strcmp(argv[i], "-subscribe")) {
+		if (++i >= argc)
+			die("Option -subscribe requires an argument");
+		client_subscribe(&sock_address, argv[i], target_socket);
+	} else if (!strcmp(argv[i], "-query")) {
+		if (++i >= argc)
+			die("Option -query requires an argument");
+		client_query(&sock_address, argv[i], target_socket);
+	} else if (!strcmp(argv[i], "-stream")) {
+		client_stream(&sock_address, target_socket);
 	} else if (!strcmp(argv[i], "-v")) {
 		printf(PROGRAM " " VERSION "\n");
 	} else if (!strcmp(argv[i], "-h")) {
@@ -4,21 +4,32 @@
 #include <errno.h>
 #include <fcft/fcft.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include <linux/input-event-codes.h>
 #include <pixman-1/pixman.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/timerfd.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
@@ -31,18 +42,52 @@
 #include "xdg-output-unstable-v1-protocol.h"
 #include "wlr-layer-shell-unstable-v1-protocol.h"
 #include "dwl-ipc-unstable-v2-protocol.h"
+#include "viewporter-protocol.h"
+#include "single-pixel-buffer-v1-protocol.h"
+#include "fractional-scale-v1-protocol.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 #define LENGTH(x)	(sizeof (x) / sizeof (x[0]))
 
+/* a bar starts with BUFFERCOUNT_MIN buffers and only grows up to
+ * BUFFERCOUNT_MAX when the compositor is holding on to all of them */
+#define BUFFERCOUNT_MIN (2)
+#define BUFFERCOUNT_MAX (3)
+
+/* set in Stats.middle when it holds a snapshot the main thread has not seen */
+#define SNAPSHOT_FRESH (1u << 2)
+
+/* laid out strings kept around for reuse, least recently used go first;
+ * the stats fields, whose text rarely comes back, have a cache of their
+ * own so they do not push out the title and status */
+#define GLYPHRUN_CACHE_SIZE (128)
+#define FIELDRUN_CACHE_SIZE (16)
+
+/* glyphs pre-blended onto the background of the stats fields */
+#define CELL_CACHE_SIZE (96)
+
+/* with a flat background, the buffers of a bar grow in steps of this many
+ * pixels to fit the window title */
+#define CONTENT_STEP (256)
+
+/* bytes of replies and state changes queued per connection, and frames a
+ * subscriber may fall behind by once those are full before it is dropped */
+#define CLIENT_RING (16384)
+#define SUBSCRIBER_LAG_MAX (64)
+
+/* rounds each widget is redrawn for per bar size in -bench-render */
+#define BENCH_ROUNDS (2000)
+
 #define PROGRAM "dwlb"
 #define VERSION "0.2"
 static const char * const usage =
 	"usage: dwlb\n"
 	"Options\n"
 	"	-v		get version information\n"
-	"	-h		view this help text\n";
+	"	-h		view this help text\n"
+	"	-bench-render [WIDTH[xSCALE]]...\n"
+	"			time rendering into offscreen bars and exit\n";
 
 typedef struct {
 	char str[5]; // three digits, a suffix (b, k, m, g, t) and a 0-byte
@@ -54,12 +99,182 @@ typedef struct {
 } Color;
 
 typedef struct {
+	const struct fcft_glyph *glyph;
+	int32_t x;
+} PlacedGlyph;
+
+/* a glyph already blended onto its background, blitted in one go when only
+ * some characters of a fixed-width field change */
+typedef struct {
+	const struct fcft_glyph *glyph;
+	Color const *color;
+	uint32_t width, height;
+	pixman_image_t *image;
+} Cell;
+
+/* a string laid out with a font within a maximum advance */
+typedef struct {
+	char *text;
+	uint32_t hash;
+	struct fcft_font *font;
+	uint32_t limit;
+
+	PlacedGlyph *glyphs;
+	uint32_t count;
+	uint32_t advance;
+
+	struct wl_list link;
+} GlyphRun;
+
+typedef struct {
+	struct wl_list runs;
+	uint32_t count, size;
+} GlyphCache;
+
+typedef struct {
+	struct wl_buffer *wl_buffer;
+	pixman_image_t *canvas;
+
+	/* areas drawn into other buffers since this one was last drawn to */
+	pixman_region32_t stale;
+
+	bool busy;
+} Buffer;
+
+/* what woke up the event loop, in the low half of epoll_event.data.u64;
+ * the high half holds the descriptor of events with more than one */
+enum {
+	EventWayland,
+	EventSocket,
+	EventStats,
+	EventAlsa,
+	EventChild,
+	EventClient,
+};
+#define EVENT(type, fd) ((uint64_t)(fd) << 32 | (type))
+
+/* a connection to the control socket, holding the part of a command
+ * received so far */
+typedef struct {
+	int fd;
+	char buf[sizeof(FrameHeader) + FRAME_PAYLOAD_MAX + 1];
+	size_t len;
+
+	/* what is yet to be sent, between head and tail of a ring of
+	 * CLIENT_RING bytes, see client_queue */
+	char *ring;
+	size_t head, tail;
+
+	/* Once subscribed, the state changes of the bars named by output.
+	 * When they no longer fit, the frames missed are counted and the full
+	 * state is sent instead once the ring has drained. */
+	bool subscribed;
+	char output[64];
+	uint32_t lag;
+
+	/* a query waits in buf, and nothing more is read, until the ring has
+	 * room for the largest reply */
+	bool deferred;
+
+	struct wl_list link;
+} Client;
+
+/* a command recently run by shell_command, see command_interval */
+typedef struct {
+	char *command;
+	struct timespec last;
+	struct wl_list link;
+} Launch;
+
+/* a piece of status text drawn in one set of colors */
+typedef struct {
+	/* offset of its zero-terminated text in Status.text */
+	uint32_t text;
+	pixman_color_t fg, bg;
+	bool has_fg, has_bg;
+
+	/* laid out relative to the start of the status, see status_layout */
+	uint32_t x, advance, limit;
+} StatusRun;
+
+/* pseudo buttons for the wheel, which no BTN_* code collides with */
+enum {
+	StatusScrollUp = 1,
+	StatusScrollDown,
+};
+
+/* a region of status text running a command when clicked or scrolled */
+typedef struct {
+	uint32_t button;
+	/* offset of its zero-terminated command in Status.text */
+	uint32_t command;
+	/* the runs it covers, first included and last not */
+	uint32_t first, last;
+} StatusButton;
+
+/* status text set through the control socket, compiled by status_parse */
+typedef struct {
+	/* as last set, so that setting it again changes nothing */
+	char *markup;
+	/* the text of every run and the command of every button */
+	char *text;
+
+	StatusRun *runs;
+	uint32_t run_count, run_size;
+	StatusButton *buttons;
+	uint32_t button_count, button_size;
+	/* some run has a background that is not opaque */
+	bool translucent;
+
+	/* what the runs were laid out for, font is NULL until they are */
+	struct fcft_font *font;
+	uint32_t limit, advance;
+	/* where it was last drawn, in buffer pixels, if it was */
+	uint32_t x;
+	bool drawn;
+} Status;
+
+/* parts of the state of a bar sent to subscribers, see subscriber_event */
+enum {
+	ChangedTags   = 1 << 0,
+	ChangedSel    = 1 << 1,
+	ChangedLayout = 1 << 2,
+	ChangedTitle  = 1 << 3,
+	ChangedAll    = (1 << 4) - 1,
+};
+
+/* fields shown on subsurfaces of their own when widget_subsurfaces is set */
+enum {
+	WidgetTime,
+	WidgetState,
+	WidgetAlsa,
+	WidgetDate, /* only with flat_background */
+	WidgetCount,
+};
+
+typedef struct Bar {
 	struct wl_output *wl_output;
 	struct wl_surface *wl_surface;
+	struct wl_subsurface *subsurface;
+	struct wl_callback *frame_callback;
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct zxdg_output_v1 *xdg_output;
 	struct zdwl_ipc_output_v2 *dwl_wm_output;
 
+	/* With a flat background, wl_surface only shows a single pixel of the
+	 * middle color stretched over the bar and the buffers go to content,
+	 * a subsurface covering the text from the left edge on */
+	struct wl_surface *content;
+	struct wl_subsurface *content_subsurface;
+	struct wp_viewport *background_viewport;
+	struct wl_buffer *background;
+
+	/* With fractional scaling, the buffers are drawn at the preferred scale
+	 * and viewport maps them back onto the surface holding them */
+	struct Scale *scale;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct wp_viewport *viewport;
+
 	struct wl_list link;
 
 	char *xdg_output_name;
@@ -67,17 +282,56 @@ typedef struct {
 
 	uint32_t registry_name;
 
+	uint32_t logical_width, logical_height;
 	uint32_t width, height;
-	uint32_t stride, bufsize;
+	uint32_t buffer_width, stride, bufsize;
+
+	/* all buffers are carved out of one shm pool, which stays mapped for
+	 * the life of the bar and is only rebuilt when the geometry changes */
+	struct wl_shm_pool *pool;
+	uint32_t *data;
+	size_t mapsize;
+	Buffer buffers[BUFFERCOUNT_MAX];
+	uint32_t buffercount;
+	Buffer *front;
+
+	/* canvas of the buffer being drawn into, only valid inside draw_frame */
+	pixman_image_t *canvas;
+	pixman_region32_t damage;
+
+	/* opaque region last given to the compositor, in buffer pixels */
+	pixman_region32_t opaque;
 
 	uint32_t mtags, ctags, urg, sel;
+	uint32_t dirty_tags;
 	uint32_t layout_idx, last_layout_idx;
+	/* Changed* since the last frame from dwl */
+	uint32_t changed;
 
 	int shm_fd;
 
 	bool configured;
 	bool hidden, bottom;
-	bool redraw_tags, redraw_window, redraw_layout, redraw;
+	/* covered by a fullscreen client, so not worth drawing */
+	bool fullscreen;
+	bool redraw_background, redraw_tags, redraw_window, redraw_layout;
+	bool redraw_stats, redraw_alsa, redraw;
+
+	/* text currently shown in each stats field, so that unchanged fields
+	 * are neither redrawn nor damaged */
+	char drawn_time[32], drawn_state[128], drawn_date[32], drawn_alsa[32];
+
+	/* status text, drawn at the right end of the title area, and a title
+	 * to show instead of the one of the focused window */
+	Status status, title;
+
+	/* parts of the shared tile not yet copied into this bar */
+	pixman_region32_t shared;
+
+	/* the subsurfaces of this bar, each a bar of its own showing the part of
+	 * the tile starting at tile_x */
+	struct Bar *widgets[WidgetCount];
+	uint32_t tile_x;
 } Bar;
 
 typedef struct {
@@ -88,16 +342,90 @@ typedef struct {
 	uint32_t pointer_x, pointer_y;
 	uint32_t pointer_button;
 
+	/* wheel motion over the volume or microphone field, in 120ths of a
+	 * notch, applied on the next frame */
+	snd_mixer_elem_t *scroll_elem;
+	bool scroll_status;
+	int32_t scroll120;
+
 	Bar *bar;
 
 	struct wl_list link;
 } Seat;
 
+/* files the collector reads when their sampler is due, see stats_sample */
+enum {
+	SourceProcStat,
+	SourceProcMeminfo,
+	SourceProcDiskstats,
+	SourceGpuHwmon,
+	SourceNetRx,
+	SourceNetTx,
+	SourceCount,
+};
+
+typedef struct {
+	int fd;
+	off_t offset;
+
+	/* receives the file contents from offset on, zero-terminated */
+	char *buf;
+	size_t size;
+	/* bytes read on the last tick, -1 if the read failed */
+	ssize_t len;
+} Source;
+
+typedef struct {
+	char name[32];
+	uint64_t prev_sectors_read;
+	uint64_t prev_sectors_written;
+	uint64_t cur_sectors_read;
+	uint64_t cur_sectors_written;
+} Disk;
+
+/* what the bars display, handed from the collector thread to the main thread */
+typedef struct {
+	uint8_t cpu_usage;
+	uint8_t mem_usage;
+	uint8_t gpu_temperature;
+	uint64_t disk_read, disk_written;
+	uint64_t net_rx, net_tx;
+	struct tm tm;
+} Snapshot;
+
+/* statistics sampled on their own period, see stats_update */
+enum {
+	SamplerCpu,
+	SamplerMem,
+	SamplerDisk,
+	SamplerGpu,
+	SamplerNet,
+	SamplerCount,
+};
+
 typedef struct {
-	/* open file descriptors */
-	int proc_stat_fd, proc_meminfo_fd, gpu_hwmon_fd;
-	int net_rx_bytes_fd,  net_tx_bytes_fd;
+	uint32_t period;
+	/* mask of 1 << Source* read before update runs */
+	uint32_t sources;
+	void (*update)(void);
+
+	/* when update last ran, and how many seconds before that */
+	time_t last;
+	uint32_t elapsed;
+} Sampler;
 
+typedef struct {
+	/* everything up to the ALSA fields is owned by the collector thread */
+
+	/* open files, the due ones refreshed in one batch per tick */
+	Source sources[SourceCount];
+	/* every file but /proc/diskstats, which has a buffer of its own that
+	 * grows with the number of block devices */
+	char source_buf[(SourceCount - 1) * 256];
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	bool use_ring;
+#endif
 
 	/* cpu */
 	uint32_t cpu_prev_total;
@@ -110,11 +438,14 @@ typedef struct {
 	/* GPU temperature */
 	uint8_t gpu_temperature;
 
-	/* disk */
+	/* disk, the running total of what the selected devices did, which
+	 * are also kept individually for a per-device display */
 	uint64_t prev_sectors_read;
 	uint64_t prev_sectors_written;
 	uint64_t cur_sectors_read;
 	uint64_t cur_sectors_written;
+	Disk disks[64];
+	uint32_t disk_count;
 
 	/* network */
 	uint64_t prev_rx_bytes;
@@ -122,13 +453,45 @@ typedef struct {
 	uint64_t cur_rx_bytes;
 	uint64_t cur_tx_bytes;
 
-	/* ALSA */
-	snd_mixer_t* mixer;
-	snd_mixer_elem_t* playback;
-	snd_mixer_elem_t* capture;
+	/* per second rates, kept between two disk or network samples */
+	uint64_t disk_read, disk_written;
+	uint64_t net_rx, net_tx;
 
 	/* time and date */
 	struct tm tm;
+
+	Sampler samplers[SamplerCount];
+
+	/* ALSA, owned by the main thread */
+	snd_mixer_t* mixer;
+	snd_mixer_elem_t* playback;
+	snd_mixer_elem_t* capture;
+	long playback_min, playback_max;
+	long capture_min, capture_max;
+	uint8_t playback_volume, capture_volume;
+	/* set by the element callbacks, see alsa_handle_events */
+	bool alsa_changed;
+	/* mixer descriptors currently in the epoll set */
+	struct pollfd alsa_fds[8];
+	int alsa_fd_count;
+
+	/* Snapshots are triple buffered: the collector fills slots[back], then
+	 * swaps it with middle; the main thread swaps front with middle
+	 * whenever middle is fresh. Neither side ever waits on the other. */
+	Snapshot slots[3];
+	uint32_t back, front;
+	_Atomic uint32_t middle;
+
+	/* signalled by the collector after every published snapshot */
+	int event_fd;
+	int timer_fd;
+	pthread_t thread;
+
+	/* the timer only runs while some bar can be seen, see stats_timer_arm;
+	 * the lock is there as the collector also rearms it on clock changes */
+	pthread_mutex_t timer_lock;
+	bool timer_armed;
+	_Atomic bool resumed;
 } Stats;
 
 typedef struct {
@@ -141,19 +504,71 @@ typedef struct {
 	uint32_t layout;
 } DrawWidths;
 
+/* everything that depends on the scale bars are drawn at, shared by all the
+ * bars on outputs with the same scale */
+typedef struct Scale {
+	uint32_t scale; /* in 120ths, like wp_fractional_scale_v1 */
+	uint32_t surface_scale; /* buffer scale, 1 when a viewport scales */
+	struct fcft_font *font;
+	uint32_t textpadding;
+	uint32_t logical_height, height;
+	DrawWidths draw_widths;
+
+	/* the clock, stats, date and ALSA fields are the same on every bar:
+	 * the time field at the left of this offscreen bar, the others at its
+	 * right edge */
+	Bar tile;
+
+	struct wl_list link;
+} Scale;
+
+static void alsa_adjust(snd_mixer_elem_t *elem, int32_t percent);
+static int alsa_elem_event(snd_mixer_elem_t *elem, unsigned int mask);
+static void alsa_handle_events(void);
 static void alsa_init(void);
 static uint8_t alsa_get_pcapture(void);
 static uint8_t alsa_get_pplayback(void);
-static void bar_free_canvas(Bar const *bar, pixman_image_t *canvas, uint32_t *data);
-static void bar_get_canvas(Bar const *bar, pixman_image_t **canvas, uint32_t **data);
+static void alsa_load_ranges(void);
+static void alsa_watch(void);
+static Buffer *bar_acquire_buffer(Bar *bar);
+static Buffer *bar_add_buffer(Bar *bar);
+static void bar_copy_shared(Bar *bar);
+static void bar_destroy_buffers(Bar *bar);
+static void bar_opaque_region(Bar const *bar, pixman_region32_t *opaque);
+static void bar_redraw_all(Bar *bar);
+static void bar_resize(Bar *bar);
+static bool bar_shares_tile(Bar const *bar);
+static bool bar_visible(Bar const *bar);
+static uint32_t bar_content_width(Bar const *bar);
+static void bench_render(int argc, char **argv);
+static void bench_report(char const *name, uint64_t *samples, size_t count);
+static int bench_sample_cmp(void const *a, void const *b);
+static pixman_image_t *cell_get(const struct fcft_glyph *glyph, Color const *color, uint32_t width, uint32_t height);
+static void cells_clear(void);
+static void client_close(Client *client);
+static bool client_flush(Client *client);
+static bool client_queue(Client *client, void const *data, size_t len);
+static void client_read(Client *client);
 static int create_shm_file(void);
+static struct wl_buffer *create_single_pixel_buffer(pixman_color_t const *color);
 static void die(const char *fmt, ...);
-static void draw_background(Bar const *bar, pixman_image_t *canvas, uint32_t x1, uint32_t x2, pixman_color_t const *color);
+static bool disk_selected(char const *name, size_t len);
+static void draw_background(Bar *bar, pixman_image_t *canvas, uint32_t x1, uint32_t x2, pixman_color_t const *color);
 static void draw_foreground(Bar const *bar, pixman_image_t *canvas, char const* text,
 		uint32_t x, uint32_t max_x, uint32_t padding, pixman_color_t const *color);
+static void draw_glyph(pixman_image_t *canvas, const struct fcft_glyph *glyph, pixman_image_t *fg_fill,
+		int32_t x, int32_t y);
+static void draw_glyph_run(Bar const *bar, pixman_image_t *canvas, GlyphRun const *run,
+		uint32_t x, pixman_color_t const *color);
 static void draw_alsa(Bar *bar);
 static void draw_layout(Bar *bar);
 static void draw_stats(Bar *bar);
+static bool draw_stats_cells(Bar *bar, char const *drawn, uint32_t x1, uint32_t x2,
+		uint32_t padding, Color const *color);
+static void draw_stats_field(Bar *bar, char *drawn, size_t size, uint32_t x1, uint32_t x2,
+		uint32_t padding, Color const *color);
+static uint32_t draw_status(Bar *bar, Status *status, uint32_t x1, uint32_t x2, bool right, Color const *color);
+static void draw_bar(Bar *bar);
 static void draw_tags(Bar *bar);
 static void draw_window_name(Bar *bar);
 static void draw_frame(Bar *bar);
@@ -172,6 +587,10 @@ static void dwl_wm_output_floating(void *data, struct zdwl_ipc_output_v2 *dwl_wm
 static void dwl_wm_tags(void *data, struct zdwl_ipc_manager_v2 *dwl_wm, uint32_t amount);
 static void event_loop(void);
 static void expand_shm_file(Bar* bar, size_t size);
+static void fractional_scale_preferred(void *data, struct wp_fractional_scale_v1 *fractional_scale, uint32_t value);
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time);
+static GlyphRun const *glyph_run_get(GlyphCache *cache, char const *text, uint32_t limit);
+static void glyph_runs_clear(void);
 static void handle_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version);
 static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name);
 static void hide_bar(Bar *bar);
@@ -182,6 +601,7 @@ static void output_done(void *data, struct zxdg_output_v1 *xdg_output);
 static void output_logical_size(void *data, struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height);
 static void output_logical_position(void *data, struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y);
 static void output_name(void *data, struct zxdg_output_v1 *xdg_output, const char *name);
+static bool parse_color(char const *text, char const *end, pixman_color_t *color);
 static uint64_t parse_trusted_uint64_t(char const** const cur);
 static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value);
 static void pointer_axis_discrete(void *data, struct wl_pointer *pointer, uint32_t axis, int32_t discrete);
@@ -192,40 +612,91 @@ static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t seri
 static void pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial,
 		struct wl_surface *surface, wl_fixed_t surface_x, wl_fixed_t surface_y);
 static void pointer_frame(void *data, struct wl_pointer *pointer);
+static void pointer_scroll(Seat *seat, int32_t value120);
 static void pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial, struct wl_surface *surface);
 static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y);
 static IOPrint print_io(uint64_t io_value);
 static void read_socket(void);
+static void reap_child(int pidfd);
+static void run_command(Client *client, char *command);
+static bool run_frame(Client *client, FrameHeader const *header, char const *payload);
 static void seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t capabilities);
 static void seat_name(void *data, struct wl_seat *wl_seat, const char *name);
 static void setup_bar(Bar *bar);
+static void setup_content(Bar *bar);
+static void setup_draw_widths(void);
+static void setup_tile(Scale *scale);
+static void setup_widgets(Bar *bar);
 static void set_top(Bar *bar);
 static void set_bottom(Bar *bar);
+static uint32_t scale_from_logical(Scale const *scale, uint32_t logical);
+static Scale *scale_get(uint32_t value);
+static uint32_t scale_to_logical(Scale const *scale, uint32_t pixels);
+static void scale_use(Scale const *scale);
+static void scales_clear(void);
+static void set_opaque_region(struct wl_surface *surface, Scale const *scale, pixman_region32_t *opaque);
 static void shell_command(char const* command);
 static void show_bar(Bar *bar);
 static void sig_handler(int sig);
 static void skip_line(char const** const cur);
 static void skip_space(char const** const cur);
 static void skip_word(char const** const cur);
+static bool stats_consume(void);
+static void stats_grow_source(int i);
+static void stats_handle_update(void);
 static void stats_init(void);
+static void stats_publish(void);
+static void stats_sample(uint32_t sources);
+static void *stats_thread(void *data);
+static void stats_timer_arm(bool armed);
+static void stats_timer_set(void);
 static void stats_update(void);
 static void stats_update_cpu(void);
 static void stats_update_disk(void);
 static void stats_update_gpu_temp(void);
 static void stats_update_mem(void);
 static void stats_update_network(void);
+static bool status_click(Status const *status, uint32_t x, uint32_t button);
+static void status_clear(Status *status);
+static void status_layout(Status *status, uint32_t limit);
+static void status_parse(Status *status, char const *markup);
+static void status_set(Bar *bar, Status *status, char const *markup);
+static void subscriber_add(Client *client, char const *output);
+static void subscriber_event(Client *client, Bar const *bar, uint32_t changed);
+static Color const *tag_color(Bar const *bar, uint32_t tag);
 static void teardown_bar(Bar *bar);
+static void teardown_content(Bar *bar);
 static void teardown_seat(Seat *seat);
+static void teardown_widgets(Bar *bar);
+static void tile_flush(void);
+static void tile_update(bool stats, bool alsa);
 static uint32_t text_width(char const* text, uint32_t maxwidth, uint32_t padding);
 static void wl_buffer_release(void *data, struct wl_buffer *wl_buffer);
 
+static int epoll_fd;
 static int sock_fd;
+/* held for accepting and dropping a connection when out of descriptors */
+static int spare_fd = -1;
+/* whether exited commands are reaped through pidfds, see shell_command */
+static bool reap_pidfds;
+static struct wl_list launches = { &launches, &launches };
+static struct wl_list clients = { &clients, &clients };
 static char *socketpath = NULL;
-static char sockbuf[256];
+static char textbuf[256];
 
 static struct wl_display *display;
 static struct wl_compositor *compositor;
+static struct wl_subcompositor *subcompositor;
+static struct wp_viewporter *viewporter;
+static struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+/* single pixel buffers of middle_color and middle_sel_color, only created
+ * with flat_background */
+static struct wl_buffer *backgrounds[2];
+static struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 static struct wl_shm *shm;
+/* XRGB8888 when every configured background is opaque, until status text
+ * brings a translucent one */
+static uint32_t shm_format = WL_SHM_FORMAT_ARGB8888;
 static struct zwlr_layer_shell_v1 *layer_shell;
 static struct zxdg_output_manager_v1 *output_manager;
 
@@ -235,18 +706,32 @@ static struct wl_surface *cursor_surface;
 
 static struct wl_list bar_list, seat_list;
 
+static struct wl_list scales = { &scales, &scales };
+
+/* font, widths and tile of the scale being drawn at, see scale_use */
 static struct fcft_font *font;
-static uint32_t height, textpadding;
+static uint32_t textpadding;
+static DrawWidths draw_widths;
+static Bar *tile;
+
+static GlyphCache text_runs = { { &text_runs.runs, &text_runs.runs }, 0, GLYPHRUN_CACHE_SIZE };
+static GlyphCache field_runs = { { &field_runs.runs, &field_runs.runs }, 0, FIELDRUN_CACHE_SIZE };
+static Cell cells[CELL_CACHE_SIZE];
+static uint32_t cell_count;
 
 static bool run_display;
+static RenderTimings render_timings;
 
 static Stats stats;
-static DrawWidths draw_widths;
 
 static const struct wl_buffer_listener wl_buffer_listener = {
 	.release = wl_buffer_release,
 };
 
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 	.configure = layer_surface_configure,
 	.closed = layer_surface_closed,
@@ -296,6 +781,10 @@ static const struct zdwl_ipc_output_v2_listener dwl_wm_output_listener = {
 	.floating = dwl_wm_output_floating
 };
 
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred,
+};
+
 static const struct wl_registry_listener registry_listener = {
 	.global = handle_global,
 	.global_remove = handle_global_remove
@@ -304,6 +793,86 @@ static const struct wl_registry_listener registry_listener = {
 
 #include "config.h"
 
+void
+alsa_adjust(snd_mixer_elem_t *elem, int32_t percent)
+{
+	long raw, min, max, step;
+
+	if (!percent)
+		return;
+
+	/* Start from the element rather than the bar, which may not have seen
+	 * the last adjustment yet. The new value comes back as a mixer event
+	 * like any other change. */
+	if (elem == stats.playback) {
+		snd_mixer_selem_get_playback_volume(elem, 0, &raw);
+		min = stats.playback_min;
+		max = stats.playback_max;
+	} else {
+		snd_mixer_selem_get_capture_volume(elem, 0, &raw);
+		min = stats.capture_min;
+		max = stats.capture_max;
+	}
+
+	/* Step in raw units, and by at least one of them, or a percent that
+	 * rounds back to the same value leaves mixers with few steps stuck */
+	step = percent * (max - min) / 100;
+	if (!step)
+		step = percent < 0 ? -1 : 1;
+	raw = MIN(MAX(raw + step, min), max);
+	if (elem == stats.playback)
+		snd_mixer_selem_set_playback_volume_all(elem, raw);
+	else
+		snd_mixer_selem_set_capture_volume_all(elem, raw);
+}
+
+int
+alsa_elem_event(snd_mixer_elem_t *elem, unsigned int mask)
+{
+	uint8_t volume;
+
+	if (mask == SND_CTL_EVENT_MASK_REMOVE)
+		die("disconnected from alsa");
+	if (mask & SND_CTL_EVENT_MASK_INFO)
+		alsa_load_ranges();
+	if (!(mask & (SND_CTL_EVENT_MASK_VALUE | SND_CTL_EVENT_MASK_INFO)))
+		return 0;
+
+	if (elem == stats.playback) {
+		volume = alsa_get_pplayback();
+		stats.alsa_changed |= volume != stats.playback_volume;
+		stats.playback_volume = volume;
+	} else if (elem == stats.capture) {
+		volume = alsa_get_pcapture();
+		stats.alsa_changed |= volume != stats.capture_volume;
+		stats.capture_volume = volume;
+	}
+	return 0;
+}
+
+void
+alsa_handle_events(void)
+{
+	Bar *bar;
+
+	/* the element callbacks sample each changed element once, however
+	 * many descriptors were readable */
+	stats.alsa_changed = false;
+	if (snd_mixer_handle_events(stats.mixer) < 0)
+		die("disconnected from alsa");
+	alsa_watch();
+	if (!stats.alsa_changed)
+		return;
+
+	tile_update(false, true);
+	wl_list_for_each(bar, &bar_list, link) {
+		if (bar_shares_tile(bar))
+			continue;
+		bar->redraw_alsa = true;
+		bar->redraw = true;
+	}
+}
+
 void
 alsa_init(void)
 {
@@ -345,44 +914,726 @@ alsa_init(void)
 	}
 
 	snd_mixer_selem_id_free(sid);
+
+	snd_mixer_elem_set_callback(stats.playback, alsa_elem_event);
+	snd_mixer_elem_set_callback(stats.capture, alsa_elem_event);
+	alsa_load_ranges();
+	stats.playback_volume = alsa_get_pplayback();
+	stats.capture_volume = alsa_get_pcapture();
 }
 
 uint8_t
 alsa_get_pcapture(void)
 {
-    long minv, maxv, invol;
-    snd_mixer_selem_get_capture_volume_range(stats.capture, &minv, &maxv);
+	long maxv, invol;
 	snd_mixer_selem_get_capture_volume(stats.capture, 0, &invol);
-	maxv -= minv;
-	invol -= minv;
+	maxv = MAX(stats.capture_max - stats.capture_min, 1);
+	invol -= stats.capture_min;
 	return ((invol * 100) + maxv / 2) / maxv;
 }
 
 uint8_t
 alsa_get_pplayback(void)
 {
-    long minv, maxv, outvol;
-    snd_mixer_selem_get_playback_volume_range(stats.playback, &minv, &maxv);
+	long maxv, outvol;
 	snd_mixer_selem_get_playback_volume(stats.playback, 0, &outvol);
-	maxv -= minv;
-	outvol -= minv;
+	maxv = MAX(stats.playback_max - stats.playback_min, 1);
+	outvol -= stats.playback_min;
 	return ((outvol * 100) + maxv / 2) / maxv;
 }
 
 void
-bar_free_canvas(Bar const *bar, pixman_image_t *canvas, uint32_t *data)
+alsa_load_ranges(void)
+{
+	/* the ranges only change along with the element info, see
+	 * alsa_elem_event */
+	snd_mixer_selem_get_playback_volume_range(stats.playback, &stats.playback_min, &stats.playback_max);
+	snd_mixer_selem_get_capture_volume_range(stats.capture, &stats.capture_min, &stats.capture_max);
+}
+
+void
+alsa_watch(void)
+{
+	struct pollfd fds[LENGTH(stats.alsa_fds)];
+	struct epoll_event ev = { .data.u64 = EVENT(EventAlsa, 0) };
+	int count, i;
+
+	/* The descriptors only change when the mixer gains or loses a control
+	 * device, so this is nearly always a comparison and nothing else */
+	if ((count = snd_mixer_poll_descriptors(stats.mixer, fds, LENGTH(fds))) < 0)
+		die("failed to get alsa poll descriptors");
+	for (i = 0; i < count && i < stats.alsa_fd_count; ++i)
+		if (fds[i].fd != stats.alsa_fds[i].fd || fds[i].events != stats.alsa_fds[i].events)
+			break;
+	if (i == count && count == stats.alsa_fd_count)
+		return;
+
+	for (i = 0; i < stats.alsa_fd_count; ++i)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stats.alsa_fds[i].fd, NULL);
+	for (i = 0; i < count; ++i) {
+		/* poll and epoll share the bits for these events */
+		ev.events = fds[i].events;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i].fd, &ev) == -1)
+			die("epoll_ctl:");
+		stats.alsa_fds[i] = fds[i];
+	}
+	stats.alsa_fd_count = count;
+}
+
+Buffer *
+bar_acquire_buffer(Bar *bar)
+{
+	Buffer *buf = NULL;
+	pixman_box32_t *boxes;
+	int nboxes;
+
+	for (uint32_t i = 0; i < bar->buffercount; ++i) {
+		if (!bar->buffers[i].busy) {
+			buf = &bar->buffers[i];
+			break;
+		}
+	}
+	if (!buf) {
+		if (bar->buffercount == BUFFERCOUNT_MAX)
+			return NULL;
+		buf = bar_add_buffer(bar);
+	}
+
+	/* Bring the buffer up to date with the last committed one, copying
+	 * over only what was drawn since it was last used */
+	if (bar->front && buf != bar->front) {
+		boxes = pixman_region32_rectangles(&buf->stale, &nboxes);
+		for (int i = 0; i < nboxes; ++i)
+			pixman_image_composite32(
+					PIXMAN_OP_SRC, bar->front->canvas, NULL, buf->canvas,
+					boxes[i].x1, boxes[i].y1, 0, 0, boxes[i].x1, boxes[i].y1,
+					boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1);
+	}
+	pixman_region32_clear(&buf->stale);
+
+	return buf;
+}
+
+Buffer *
+bar_add_buffer(Bar *bar)
+{
+	const size_t size = (size_t)bar->stride * bar->height;
+	const size_t offset = size * bar->buffercount;
+	Buffer *buf = &bar->buffers[bar->buffercount];
+
+	expand_shm_file(bar, offset + size);
+	if (bar->shm_fd == -1)
+		die("failed to resize shm file");
+
+	/* The mapping and the pool cover the whole file, so both have to
+	 * follow it when it grows */
+	if (bar->mapsize < bar->bufsize) {
+		if (bar->data)
+			munmap(bar->data, bar->mapsize);
+		bar->data = mmap(NULL, bar->bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, bar->shm_fd, 0);
+		if (bar->data == MAP_FAILED)
+			die("shared memory mmap:");
+		bar->mapsize = bar->bufsize;
+
+		for (uint32_t i = 0; i < bar->buffercount; ++i) {
+			pixman_image_unref(bar->buffers[i].canvas);
+			bar->buffers[i].canvas = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->buffer_width, bar->height,
+					bar->data + (size * i) / 4, bar->stride);
+		}
+
+		if (bar->pool)
+			wl_shm_pool_resize(bar->pool, bar->bufsize);
+		else
+			bar->pool = wl_shm_create_pool(shm, bar->shm_fd, bar->bufsize);
+	}
+
+	buf->wl_buffer = wl_shm_pool_create_buffer(bar->pool, offset, bar->buffer_width, bar->height,
+			bar->stride, shm_format);
+	wl_buffer_add_listener(buf->wl_buffer, &wl_buffer_listener, buf);
+	buf->canvas = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->buffer_width, bar->height,
+			bar->data + offset / 4, bar->stride);
+	pixman_region32_init_rect(&buf->stale, 0, 0, bar->buffer_width, bar->height);
+	buf->busy = false;
+	++bar->buffercount;
+
+	return buf;
+}
+
+uint32_t
+bar_content_width(Bar const *bar)
+{
+	const uint32_t x = draw_widths.time + draw_widths.tag * TAGCOUNT + draw_widths.layout;
+	const uint32_t max_x = bar->width - MIN(bar->width, draw_widths.state + draw_widths.alsa + draw_widths.date);
+	const uint32_t surface_scale = bar->scale->surface_scale;
+	const uint32_t step = CONTENT_STEP * surface_scale;
+	uint32_t width = x;
+
+	/* without widgets, the fields on the right are drawn into it too */
+	if (!bar_shares_tile(bar))
+		return bar->width;
+
+	/* the status sits at the right end of the title area */
+	if (bar->status.run_count || bar->title.run_count)
+		width = max_x;
+	else if (x < max_x)
+		width += text_width(bar->window_title, max_x - x, textpadding);
+	width = MIN((width + step - 1) / step * step, max_x);
+
+	/* buffers have to be a whole number of surface pixels wide */
+	return (MAX(width, 1) + surface_scale - 1) / surface_scale * surface_scale;
+}
+
+void
+bar_copy_shared(Bar *bar)
+{
+	int n;
+	pixman_box32_t *box;
+	int32_t x1, x2;
+	const int32_t split = draw_widths.time;
+	const int32_t offset = bar->width - tile->width;
+
+	box = pixman_region32_rectangles(&bar->shared, &n);
+	for (int i = 0; i < n; ++i, ++box) {
+		/* a widget only holds its own part of the tile */
+		if (bar->subsurface) {
+			pixman_image_composite32(PIXMAN_OP_SRC, tile->canvas, NULL, bar->canvas,
+					box->x1, box->y1, 0, 0, box->x1 - bar->tile_x, box->y1,
+					box->x2 - box->x1, box->y2 - box->y1);
+			pixman_region32_union_rect(&bar->damage, &bar->damage, box->x1 - bar->tile_x, box->y1,
+					box->x2 - box->x1, box->y2 - box->y1);
+			continue;
+		}
+
+		/* the time field keeps its position, the rest of the tile is
+		 * moved to the right edge of the bar */
+		if ((x2 = MIN(box->x2, split)) > box->x1) {
+			pixman_image_composite32(PIXMAN_OP_SRC, tile->canvas, NULL, bar->canvas,
+					box->x1, box->y1, 0, 0, box->x1, box->y1,
+					x2 - box->x1, box->y2 - box->y1);
+			pixman_region32_union_rect(&bar->damage, &bar->damage,
+					box->x1, box->y1, x2 - box->x1, box->y2 - box->y1);
+		}
+		if ((x1 = MAX(box->x1, split)) < box->x2) {
+			pixman_image_composite32(PIXMAN_OP_SRC, tile->canvas, NULL, bar->canvas,
+					x1, box->y1, 0, 0, x1 + offset, box->y1,
+					box->x2 - x1, box->y2 - box->y1);
+			pixman_region32_union_rect(&bar->damage, &bar->damage,
+					x1 + offset, box->y1, box->x2 - x1, box->y2 - box->y1);
+		}
+	}
+	pixman_region32_clear(&bar->shared);
+}
+
+void
+bar_destroy_buffers(Bar *bar)
+{
+	bool busy = false;
+
+	for (uint32_t i = 0; i < bar->buffercount; ++i) {
+		busy |= bar->buffers[i].busy;
+		wl_buffer_destroy(bar->buffers[i].wl_buffer);
+		pixman_image_unref(bar->buffers[i].canvas);
+		pixman_region32_fini(&bar->buffers[i].stale);
+	}
+	bar->buffercount = 0;
+	bar->front = NULL;
+	bar->canvas = NULL;
+
+	if (bar->pool) {
+		wl_shm_pool_destroy(bar->pool);
+		bar->pool = NULL;
+	}
+	if (bar->data) {
+		munmap(bar->data, bar->mapsize);
+		bar->data = NULL;
+		bar->mapsize = 0;
+	}
+
+	/* The compositor may still be reading a buffer it has not released,
+	 * so the next ones go into a file of their own rather than drawing
+	 * over it; the old file goes away with the compositor's mapping */
+	if (busy && bar->shm_fd >= 0) {
+		close(bar->shm_fd);
+		bar->shm_fd = create_shm_file();
+		bar->bufsize = 0;
+	}
+}
+
+void
+bar_opaque_region(Bar const *bar, pixman_region32_t *opaque)
+{
+	const uint32_t right = MIN(bar->width, draw_widths.state + draw_widths.alsa + draw_widths.date);
+	const uint32_t title_x = MIN(draw_widths.time + draw_widths.tag * TAGCOUNT + draw_widths.layout,
+			bar->width - right);
+	struct {
+		uint32_t x1, x2;
+		Color const *color;
+	} spans[TAGCOUNT + 6] = {
+		{ 0, draw_widths.time, &time_color },
+		{ title_x - draw_widths.layout, title_x, &inactive_color },
+		{ title_x, bar->status.translucent || bar->title.translucent ? title_x : bar->width - right,
+		  bar->sel ? &middle_sel_color : &middle_color },
+		{ bar->width - right, bar->width - right + draw_widths.state, &inactive_color },
+		{ bar->width - draw_widths.alsa - draw_widths.date, bar->width - draw_widths.date, &inactive_color },
+		{ bar->width - draw_widths.date, bar->width, &active_color },
+	};
+	int count = 6;
+
+	for (uint32_t i = 0; i < TAGCOUNT; ++i, ++count) {
+		spans[count].x1 = draw_widths.time + draw_widths.tag * i;
+		spans[count].x2 = spans[count].x1 + draw_widths.tag;
+		spans[count].color = tag_color(bar, i);
+	}
+
+	/* Text and tag boxes are blended over their background, so a span is
+	 * opaque exactly when its background color is. Only what the buffers
+	 * cover counts. */
+	pixman_region32_clear(opaque);
+	for (int i = 0; i < count; ++i)
+		if (spans[i].color->bg.alpha == 0xffff && spans[i].x1 < MIN(spans[i].x2, bar->buffer_width))
+			pixman_region32_union_rect(opaque, opaque, spans[i].x1, 0,
+					MIN(spans[i].x2, bar->buffer_width) - spans[i].x1, bar->height);
+}
+
+void
+bar_redraw_all(Bar *bar)
+{
+	bar->dirty_tags = (1 << TAGCOUNT) - 1;
+	bar->drawn_time[0] = '\0';
+	bar->drawn_state[0] = '\0';
+	bar->drawn_date[0] = '\0';
+	bar->drawn_alsa[0] = '\0';
+	pixman_region32_union_rect(&bar->shared, &bar->shared, 0, 0, tile->width, tile->height);
+	bar->redraw_background = true;
+	bar->redraw_alsa = true;
+	bar->redraw_tags = true;
+	bar->redraw_layout = true;
+	bar->redraw_window = true;
+	bar->redraw_stats = true;
+	bar->redraw = true;
+}
+
+void
+bar_resize(Bar *bar)
+{
+	const uint32_t w = scale_from_logical(bar->scale, bar->logical_width);
+	const uint32_t h = scale_from_logical(bar->scale, bar->logical_height);
+
+	scale_use(bar->scale);
+	if (w != bar->width || h != bar->height) {
+		bar_destroy_buffers(bar);
+		bar->width = w;
+		bar->height = h;
+		/* with a flat background, only the part of the bar with text on
+		 * it needs a buffer */
+		bar->buffer_width = bar->content ? bar_content_width(bar) : bar->width;
+		bar->stride = bar->buffer_width * 4;
+		for (uint32_t i = 0; i < BUFFERCOUNT_MIN; ++i)
+			bar_add_buffer(bar);
+	}
+	bar->configured = true;
+	bar->background = NULL;
+
+	/* a bar that became too narrow for the tile draws the fields itself,
+	 * one wide enough again takes the widgets back */
+	if (bar->widgets[0] && !bar_shares_tile(bar))
+		teardown_widgets(bar);
+	else if (!bar->widgets[0])
+		setup_widgets(bar);
+
+	/* the position of the widgets on the right follows the width of the
+	 * bar, and they are drawn from scratch too */
+	for (int i = 0; i < WidgetCount; ++i) {
+		Bar *widget = bar->widgets[i];
+		if (!widget)
+			continue;
+		wl_subsurface_set_position(widget->subsurface, scale_to_logical(bar->scale,
+				widget->tile_x < draw_widths.time ? widget->tile_x
+				: widget->tile_x + bar->width - tile->width), 0);
+		pixman_region32_union_rect(&widget->shared, &widget->shared,
+				widget->tile_x, 0, widget->width, widget->height);
+		widget->redraw = true;
+	}
+
+	/* everything is drawn from scratch */
+	bar_redraw_all(bar);
+	draw_frame(bar);
+}
+
+bool
+bar_visible(Bar const *bar)
+{
+	return !bar->hidden && bar->configured && !bar->fullscreen;
+}
+
+bool
+bar_shares_tile(Bar const *bar)
+{
+	Scale const *scale = bar->scale;
+
+	return scale && scale->tile.canvas && bar->width >= scale->tile.width
+		&& bar->height == scale->tile.height;
+}
+
+void
+bench_render(int argc, char **argv)
+{
+	static char const * const titles[] = {
+		"~/src/dwlb - foot",
+		"dwlb.c (~/src/dwlb) - NVIM",
+		"Mozilla Firefox",
+		"pixman_image_composite32 - Search — Mozilla Firefox",
+		"",
+	};
+	static char const * const symbols[] = { "[]=", "><>", "[M]" };
+	static char const * const defaults[] = { "1920x1", "2560x1", "3840x2", "7680x2" };
+	enum { BenchTags, BenchWindow, BenchLayout, BenchStats, BenchAlsa, BenchFrame, BenchCount };
+	static char const * const names[BenchCount] = { "tags", "title", "layout", "stats", "alsa", "full frame" };
+
+	uint64_t *samples[BenchCount];
+	struct timespec t0, t1;
+	Snapshot *snap = &stats.slots[stats.front];
+	uint32_t width, scale;
+	Scale *at;
+	Bar *bar;
+
+	if (!argc) {
+		argc = LENGTH(defaults);
+		argv = (char **)defaults;
+	}
+	for (int i = 0; i < BenchCount; ++i)
+		if (!(samples[i] = calloc(BENCH_ROUNDS, sizeof(uint64_t))))
+			die("calloc:");
+
+	fcft_init(FCFT_LOG_COLORIZE_AUTO, 0, FCFT_LOG_CLASS_ERROR);
+	fcft_set_scaling_filter(FCFT_SCALING_FILTER_LANCZOS3);
+
+	for (int a = 0; a < argc; ++a) {
+		scale = 1;
+		if (sscanf(argv[a], "%ux%u", &width, &scale) < 1 || !width || !scale)
+			die("Invalid bar size '%s', expected WIDTH[xSCALE]", argv[a]);
+
+		at = scale_get(scale * 120);
+		scale_use(at);
+
+		/* an offscreen bar over plain memory, nothing else is needed to
+		 * draw into it */
+		if (!(bar = calloc(1, sizeof(Bar))))
+			die("calloc:");
+		bar->width = width;
+		bar->height = at->height;
+		bar->stride = bar->width * 4;
+		if (!(bar->data = calloc(bar->height, bar->stride)))
+			die("calloc:");
+		bar->canvas = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, bar->data, bar->stride);
+		pixman_region32_init(&bar->damage);
+		strcpy(layouts[0], symbols[0]);
+		bar->layout = layouts[0];
+		bar->sel = true;
+
+		/* Replay a mix of updates: every round a tag changes state, the
+		 * title and layout switch, the clock and stats tick and the
+		 * volume moves. Each widget is timed on its own, followed by a
+		 * full redraw of the whole bar. */
+		for (uint32_t r = 0; r < BENCH_ROUNDS; ++r) {
+			bar->mtags = 1 << (r % TAGCOUNT);
+			bar->ctags ^= 1 << ((r * 7) % TAGCOUNT);
+			bar->urg = r % 31 ? 0 : 1 << ((r * 5) % TAGCOUNT);
+			bar->dirty_tags = (1 << TAGCOUNT) - 1;
+			free(bar->window_title);
+			if (!(bar->window_title = strdup(titles[r % LENGTH(titles)])))
+				die("strdup:");
+			strcpy(layouts[0], symbols[r % LENGTH(symbols)]);
+			snap->tm.tm_sec = r % 60;
+			snap->tm.tm_min = (r / 60) % 60;
+			snap->tm.tm_hour = (r / 3600) % 24;
+			snap->cpu_usage = (r * 37) % 101;
+			snap->mem_usage = (r * 13) % 101;
+			snap->gpu_temperature = 40 + r % 50;
+			snap->net_rx = (uint64_t)r * 7919;
+			snap->net_tx = (uint64_t)r * 104729;
+			snap->disk_read = r % 3 ? 0 : (uint64_t)r << 12;
+			snap->disk_written = r % 5 ? 0 : (uint64_t)r << 14;
+			stats.playback_volume = r % 101;
+			stats.capture_volume = (r / 2) % 101;
+
+			for (int w = 0; w < BenchFrame; ++w) {
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+				switch (w) {
+				case BenchTags:   draw_tags(bar);        break;
+				case BenchWindow: draw_window_name(bar); break;
+				case BenchLayout: draw_layout(bar);      break;
+				case BenchStats:  draw_stats(bar);       break;
+				case BenchAlsa:   draw_alsa(bar);        break;
+				}
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				samples[w][r] = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+			}
+
+			bar->dirty_tags = (1 << TAGCOUNT) - 1;
+			bar->drawn_time[0] = '\0';
+			bar->drawn_state[0] = '\0';
+			bar->drawn_date[0] = '\0';
+			bar->drawn_alsa[0] = '\0';
+			bar->redraw_background = true;
+			bar->redraw_alsa = true;
+			bar->redraw_tags = true;
+			bar->redraw_layout = true;
+			bar->redraw_window = true;
+			bar->redraw_stats = true;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			draw_bar(bar);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			samples[BenchFrame][r] = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+			pixman_region32_clear(&bar->damage);
+		}
+
+		printf("%ux%u (%ux%u pixels, %u rounds)\n", width, scale, bar->width, bar->height, BENCH_ROUNDS);
+		printf("  %-12s %10s %10s %10s %10s %10s\n", "ns", "mean", "p50", "p90", "p99", "max");
+		for (int w = 0; w < BenchCount; ++w)
+			bench_report(names[w], samples[w], BENCH_ROUNDS);
+
+		free(bar->window_title);
+		pixman_image_unref(bar->canvas);
+		pixman_region32_fini(&bar->damage);
+		free(bar->data);
+		free(bar);
+		cells_clear();
+		glyph_runs_clear();
+		scales_clear();
+	}
+
+	for (int i = 0; i < BenchCount; ++i)
+		free(samples[i]);
+	fcft_fini();
+}
+
+void
+bench_report(char const *name, uint64_t *samples, size_t count)
+{
+	uint64_t sum = 0;
+
+	qsort(samples, count, sizeof *samples, bench_sample_cmp);
+	for (size_t i = 0; i < count; ++i)
+		sum += samples[i];
+	printf("  %-12s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", name,
+			sum / count,
+			samples[count / 2],
+			samples[count * 9 / 10],
+			samples[count * 99 / 100],
+			samples[count - 1]);
+}
+
+int
+bench_sample_cmp(void const *a, void const *b)
+{
+	uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+pixman_image_t *
+cell_get(const struct fcft_glyph *glyph, Color const *color, uint32_t width, uint32_t height)
+{
+	Cell *cell;
+
+	for (uint32_t i = 0; i < cell_count; ++i) {
+		cell = &cells[i];
+		if (cell->glyph == glyph && cell->color == color && cell->width == width && cell->height == height)
+			return cell->image;
+	}
+	/* Digits, units and separators fill up the cache within a few ticks;
+	 * anything beyond that is just drawn the slow way */
+	if (cell_count == CELL_CACHE_SIZE)
+		return NULL;
+
+	cell = &cells[cell_count++];
+	cell->glyph = glyph;
+	cell->color = color;
+	cell->width = width;
+	cell->height = height;
+	cell->image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, NULL, 0);
+	pixman_image_fill_boxes(PIXMAN_OP_SRC, cell->image, &color->bg, 1,
+			&(pixman_box32_t){ 0, 0, width, height });
+	pixman_image_t *fg_fill = pixman_image_create_solid_fill(&color->fg);
+	draw_glyph(cell->image, glyph, fg_fill, 0, (height + font->ascent - font->descent) / 2);
+	pixman_image_unref(fg_fill);
+
+	return cell->image;
+}
+
+void
+cells_clear(void)
+{
+	for (uint32_t i = 0; i < cell_count; ++i)
+		pixman_image_unref(cells[i].image);
+	cell_count = 0;
+}
+
+void
+client_close(Client *client)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	wl_list_remove(&client->link);
+	free(client->ring);
+	free(client);
+
+	/* the descriptor just freed takes the place of a spare that could
+	 * not be had back after the last time it was used */
+	if (spare_fd == -1)
+		spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+bool
+client_flush(Client *client)
+{
+	struct epoll_event ev = { .data.u64 = EVENT(EventClient, client->fd) };
+	const size_t start = client->head % CLIENT_RING;
+	const size_t used = client->tail - client->head;
+	struct iovec iov[2] = {
+		{ client->ring + start, MIN(used, CLIENT_RING - start) },
+		{ client->ring, used - MIN(used, CLIENT_RING - start) },
+	};
+	const struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t len;
+	Bar *bar;
+
+	if (used) {
+		len = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			client_close(client);
+			return false;
+		}
+		if (len > 0)
+			client->head += len;
+	}
+
+	/* Caught up after falling behind, which the current state of every
+	 * bar makes up for; queueing it asks for another flush */
+	if (client->head == client->tail && client->lag) {
+		client->lag = 0;
+		wl_list_for_each(bar, &bar_list, link)
+			subscriber_event(client, bar, ChangedAll);
+		return true;
+	}
+
+	/* only wait for the socket to take more while something is left */
+	ev.events = EPOLLIN | (client->head != client->tail ? EPOLLOUT : 0);
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+	return true;
+}
+
+bool
+client_queue(Client *client, void const *data, size_t len)
 {
-	pixman_image_unref(canvas);
-	munmap(data, bar->bufsize);
+	const size_t used = client->tail - client->head;
+
+	if (!client->ring && !(client->ring = malloc(CLIENT_RING)))
+		return false;
+	if (len > CLIENT_RING - used)
+		return false;
+	for (size_t i = 0; i < len; ++i)
+		client->ring[(client->tail + i) % CLIENT_RING] = ((char const *)data)[i];
+	client->tail += len;
+
+	/* sent by the event loop once the socket can take it */
+	if (!used) {
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.u64 = EVENT(EventClient, client->fd) };
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+	}
+	return true;
 }
 
 void
-bar_get_canvas(Bar const *bar, pixman_image_t **canvas, uint32_t **data)
+client_read(Client *client)
+{
+	FrameHeader header;
+	char *start, *end, *nl;
+	ssize_t len;
+
+	/* Take everything there is, however many commands that is, so that
+	 * a script sending a burst of them costs a single wakeup */
+	for (;;) {
+		/* text commands are terminated by newlines, frames carry their
+		 * length */
+		start = client->buf;
+		end = client->buf + client->len;
+		client->deferred = false;
+		while (start < end) {
+			if ((uint8_t)*start == FRAME_MAGIC) {
+				if ((size_t)(end - start) < sizeof header)
+					break;
+				memcpy(&header, start, sizeof header);
+				if (header.length > FRAME_PAYLOAD_MAX) {
+					client_close(client);
+					return;
+				}
+				if ((size_t)(end - start) < sizeof header + header.length)
+					break;
+				if (header.opcode != OpcodeBatch
+				    && CLIENT_RING - (client->tail - client->head) < sizeof header + FRAME_PAYLOAD_MAX) {
+					client->deferred = true;
+					break;
+				}
+				if (!run_frame(client, &header, start + sizeof header)) {
+					client_close(client);
+					return;
+				}
+				start += sizeof header + header.length;
+			} else {
+				if (!(nl = memchr(start, '\n', end - start)))
+					break;
+				*nl = '\0';
+				if (nl > start)
+					run_command(client, start);
+				start = nl + 1;
+			}
+		}
+		client->len = end - start;
+		memmove(client->buf, start, client->len);
+
+		/* picked up again by the event loop once the ring drained */
+		if (client->deferred) {
+			struct epoll_event ev = { .events = EPOLLOUT, .data.u64 = EVENT(EventClient, client->fd) };
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+			return;
+		}
+
+		/* no command is anywhere near this long */
+		if (client->len == sizeof client->buf - 1) {
+			client_close(client);
+			return;
+		}
+
+		len = recv(client->fd, client->buf + client->len, sizeof client->buf - 1 - client->len, 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client_close(client);
+			return;
+		}
+		if (len == 0) {
+			/* the last text command may end with the connection instead */
+			if (client->len && (uint8_t)client->buf[0] != FRAME_MAGIC) {
+				client->buf[client->len] = '\0';
+				run_command(client, client->buf);
+			}
+			client_close(client);
+			return;
+		}
+		client->len += len;
+	}
+}
+
+struct wl_buffer *
+create_single_pixel_buffer(pixman_color_t const *color)
 {
-	*data = mmap(NULL, bar->bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, bar->shm_fd, 0);
-	if (data == MAP_FAILED)
-		die("shared memory mmap:");
-	*canvas = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, *data, bar->width * 4);
+	/* the same channel values the shm buffers would hold, widened to
+	 * 32 bits */
+	return wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(single_pixel_buffer_manager,
+			color->red * 0x10001u, color->green * 0x10001u,
+			color->blue * 0x10001u, color->alpha * 0x10001u);
 }
 
 int
@@ -424,9 +1675,60 @@ die(const char *fmt, ...)
 	exit(1);
 }
 
+bool
+disk_selected(char const *name, size_t len)
+{
+	if (disk_devices[0]) {
+		for (char const * const *dev = disk_devices; *dev; ++dev)
+			if (strlen(*dev) == len && !strncmp(*dev, name, len))
+				return true;
+		return false;
+	}
+
+	for (char const * const *prefix = disk_ignore; *prefix; ++prefix)
+		if (strlen(*prefix) <= len && !strncmp(*prefix, name, strlen(*prefix)))
+			return false;
+	return true;
+}
+
+void
+draw_bar(Bar *bar)
+{
+	if (bar->subsurface) {
+		bar_copy_shared(bar);
+		bar->redraw = false;
+		return;
+	}
+
+	if (bar->redraw_background)
+		draw_background(
+				bar,
+				bar->canvas,
+				draw_widths.time,
+				bar->width - (draw_widths.state + draw_widths.alsa + draw_widths.date),
+				bar->sel ? &middle_sel_color.bg : &middle_color.bg);
+	if (bar->redraw_tags)   draw_tags(bar);
+	if (bar->redraw_layout) draw_layout(bar);
+	if (bar->redraw_window) draw_window_name(bar);
+	if (bar_shares_tile(bar)) {
+		bar_copy_shared(bar);
+	} else {
+		if (bar->redraw_alsa)  draw_alsa(bar);
+		if (bar->redraw_stats) draw_stats(bar);
+	}
+
+	bar->redraw = false;
+	bar->redraw_background = false;
+	bar->redraw_alsa = false;
+	bar->redraw_tags = false;
+	bar->redraw_layout = false;
+	bar->redraw_window = false;
+	bar->redraw_stats = false;
+}
+
 void
 draw_background(
-	Bar const *bar,
+	Bar *bar,
 	pixman_image_t *canvas,
 	uint32_t x1,
 	uint32_t x2,
@@ -435,6 +1737,7 @@ draw_background(
 	if (x1 >= x2 || x1 >= bar->width)
 		return;
 	x2 = MIN(x2, bar->width);
+	pixman_region32_union_rect(&bar->damage, &bar->damage, x1, 0, x2 - x1, bar->height);
 	pixman_image_fill_boxes(
 			PIXMAN_OP_SRC,
 			canvas,
@@ -457,7 +1760,7 @@ draw_foreground(
 	pixman_color_t const *color)
 {
 	uint32_t nx;
-	uint32_t y = (bar->height + font->ascent - font->descent) / 2;
+	GlyphRun const *run;
 	if (!text || !*text || !max_x)
 		return;
 
@@ -465,48 +1768,44 @@ draw_foreground(
 		return;
 	x = nx;
 
-	pixman_image_t *fg_fill = pixman_image_create_solid_fill(color);
-	uint32_t codepoint, state = UTF8_ACCEPT, last_cp = 0;
-	for (char const *p = text; *p; p++) {
-		/* Returns nonzero if more bytes are needed */
-		if (utf8decode(&state, &codepoint, *p))
-			continue;
+	run = glyph_run_get(&text_runs, text, max_x - x - padding);
+	draw_glyph_run(bar, canvas, run, x, color);
+}
 
-		/* Turn off subpixel rendering, which complicates things when
-		 * mixed with alpha channels */
-		const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
-		if (!glyph)
-			continue;
+void
+draw_glyph(pixman_image_t *canvas, const struct fcft_glyph *glyph, pixman_image_t *fg_fill,
+	int32_t x, int32_t y)
+{
+	/* Detect and handle pre-rendered glyphs (e.g. emoji) */
+	if (pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8) {
+		/* Only the alpha channel of the mask is used, so we can
+		 * use fgfill here to blend prerendered glyphs with the
+		 * same opacity */
+		pixman_image_composite32(
+				PIXMAN_OP_OVER, glyph->pix, fg_fill, canvas, 0, 0, 0, 0,
+				x + glyph->x, y - glyph->y, glyph->width, glyph->height);
+	} else {
+		/* Applying the foreground color here would mess up
+		 * component alphas for subpixel-rendered text, so we
+		 * apply it when blending. */
+		pixman_image_composite32(
+				PIXMAN_OP_OVER, fg_fill, glyph->pix, canvas, 0, 0, 0, 0,
+				x + glyph->x, y - glyph->y, glyph->width, glyph->height);
+	}
+}
 
-		/* Adjust x position based on kerning with previous glyph */
-		long kern = 0;
-		if (last_cp)
-			fcft_kerning(font, last_cp, codepoint, &kern, NULL);
-		if ((nx = x + kern + glyph->advance.x) + padding > max_x)
-			break;
-		last_cp = codepoint;
-		x += kern;
+void
+draw_glyph_run(Bar const *bar, pixman_image_t *canvas, GlyphRun const *run,
+	uint32_t x, pixman_color_t const *color)
+{
+	uint32_t y = (bar->height + font->ascent - font->descent) / 2;
 
-		/* Detect and handle pre-rendered glyphs (e.g. emoji) */
-		if (pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8) {
-			/* Only the alpha channel of the mask is used, so we can
-			 * use fgfill here to blend prerendered glyphs with the
-			 * same opacity */
-			pixman_image_composite32(
-					PIXMAN_OP_OVER, glyph->pix, fg_fill, canvas, 0, 0, 0, 0,
-					x + glyph->x, y - glyph->y, glyph->width, glyph->height);
-		} else {
-			/* Applying the foreground color here would mess up
-			 * component alphas for subpixel-rendered text, so we
-			 * apply it when blending. */
-			pixman_image_composite32(
-					PIXMAN_OP_OVER, fg_fill, glyph->pix, canvas, 0, 0, 0, 0,
-					x + glyph->x, y - glyph->y, glyph->width, glyph->height);
-		}
+	if (!run->count)
+		return;
 
-		/* increment pen position */
-		x = nx;
-	}
+	pixman_image_t *fg_fill = pixman_image_create_solid_fill(color);
+	for (uint32_t i = 0; i < run->count; ++i)
+		draw_glyph(canvas, run->glyphs[i].glyph, fg_fill, x + run->glyphs[i].x, y);
 
 	pixman_image_unref(fg_fill);
 }
@@ -514,104 +1813,214 @@ draw_foreground(
 void
 draw_alsa(Bar *bar)
 {
-	pixman_image_t *canvas;
-	uint32_t *data, x1, x2;
+	uint32_t x1, x2;
 
-	bar_get_canvas(bar, &canvas, &data);
+	if (!bar->canvas)
+		return;
 
-	snprintf(sockbuf, 256, bar_alsa_fmt, alsa_get_pplayback(), alsa_get_pcapture());
+	snprintf(textbuf, 256, bar_alsa_fmt, stats.playback_volume, stats.capture_volume);
 	x2 = bar->width - draw_widths.date;
 	x1 = x2 - draw_widths.alsa;
-	draw_background(bar, canvas, x1, x2, &inactive_color.bg);
-	draw_foreground(bar, canvas, sockbuf, x1, x2, textpadding / 2, &inactive_color.fg);
-
-	bar_free_canvas(bar, canvas, data);
+	draw_stats_field(bar, bar->drawn_alsa, sizeof bar->drawn_alsa,
+			x1, x2, textpadding / 2, &inactive_color);
 }
 
 void
 draw_layout(Bar *bar)
 {
-	pixman_image_t *canvas;
-	uint32_t *data;
 	const uint32_t x = draw_widths.time + draw_widths.tag * TAGCOUNT;
 
-	bar_get_canvas(bar, &canvas, &data);
+	if (!bar->canvas)
+		return;
 
-	draw_background(bar, canvas, x, x + draw_widths.layout, &inactive_color.bg);
-	draw_foreground(bar, canvas, bar->layout, x, x + draw_widths.layout,
+	draw_background(bar, bar->canvas, x, x + draw_widths.layout, &inactive_color.bg);
+	draw_foreground(bar, bar->canvas, bar->layout, x, x + draw_widths.layout,
 			textpadding, &inactive_color.fg);
-
-	bar_free_canvas(bar, canvas, data);
 }
 
 void
 draw_stats(Bar *bar)
 {
-	pixman_image_t *canvas;
-	uint32_t *data, x1, x2;
+	uint32_t x1, x2;
+	Snapshot const *snap = &stats.slots[stats.front];
 
-	bar_get_canvas(bar, &canvas, &data);
+	if (!bar->canvas)
+		return;
 
-	snprintf(sockbuf, 256, bar_time_fmt,
-			stats.tm.tm_hour,
-			stats.tm.tm_min,
-			stats.tm.tm_sec);
-	draw_background(bar, canvas, 0, draw_widths.time, &time_color.bg);
-	draw_foreground(bar, canvas, sockbuf, 0, draw_widths.time, textpadding / 2, &time_color.fg);
+	snprintf(textbuf, 256, bar_time_fmt,
+			snap->tm.tm_hour,
+			snap->tm.tm_min,
+			snap->tm.tm_sec);
+	draw_stats_field(bar, bar->drawn_time, sizeof bar->drawn_time,
+			0, draw_widths.time, textpadding / 2, &time_color);
 
 	x2 = MIN(bar->width, bar->width - (draw_widths.alsa + draw_widths.date));
 	x1 = x2 - draw_widths.state;
-	snprintf(sockbuf, 256, bar_state_fmt,
-			print_io(stats.cur_tx_bytes - stats.prev_tx_bytes).str,
-			print_io(stats.cur_rx_bytes - stats.prev_rx_bytes).str,
-			print_io((stats.cur_sectors_read - stats.prev_sectors_read) * 512).str,
-			print_io((stats.cur_sectors_written - stats.prev_sectors_written) * 512).str,
-			stats.gpu_temperature,
-			stats.cpu_usage,
-			stats.mem_usage);
-	draw_background(bar, canvas, x1, x2, &inactive_color.bg);
-	draw_foreground(bar, canvas, sockbuf, x1, x2, textpadding, &inactive_color.fg);
+	snprintf(textbuf, 256, bar_state_fmt,
+			print_io(snap->net_tx).str,
+			print_io(snap->net_rx).str,
+			print_io(snap->disk_read).str,
+			print_io(snap->disk_written).str,
+			snap->gpu_temperature,
+			snap->cpu_usage,
+			snap->mem_usage);
+	draw_stats_field(bar, bar->drawn_state, sizeof bar->drawn_state,
+			x1, x2, textpadding, &inactive_color);
 
 	x2 = bar->width;
 	x1 = MIN(bar->width, bar->width - draw_widths.date);
-	snprintf(sockbuf, 256, bar_date_fmt,
-		stats.tm.tm_mday,
-		stats.tm.tm_mon + 1,
-		stats.tm.tm_year + 1900);
-	draw_background(bar, canvas, x1, x2, &active_color.bg);
-	draw_foreground(bar, canvas, sockbuf, x1, x2, textpadding / 2, &active_color.fg);
+	snprintf(textbuf, 256, bar_date_fmt,
+		snap->tm.tm_mday,
+		snap->tm.tm_mon + 1,
+		snap->tm.tm_year + 1900);
+	draw_stats_field(bar, bar->drawn_date, sizeof bar->drawn_date,
+			x1, x2, textpadding / 2, &active_color);
+}
+
+bool
+draw_stats_cells(Bar *bar, char const *drawn, uint32_t x1, uint32_t x2,
+	uint32_t padding, Color const *color)
+{
+	GlyphRun const *old, *new;
+	const struct fcft_glyph *glyph;
+	pixman_image_t *image;
+	uint32_t x, y, cx1, cx2;
+
+	if (x1 + padding * 2 >= x2 || x2 > bar->width)
+		return false;
+	x = x1 + padding;
+	y = (bar->height + font->ascent - font->descent) / 2;
+
+	/* Cells only work if both strings put their glyphs at the same
+	 * positions, which is the case for a fixed-width format rendered
+	 * with a monospace font */
+	old = glyph_run_get(&field_runs, drawn, x2 - x - padding);
+	new = glyph_run_get(&field_runs, textbuf, x2 - x - padding);
+	if (old->count != new->count || old->advance != new->advance)
+		return false;
+	for (uint32_t i = 0; i < new->count; ++i) {
+		if (old->glyphs[i].x != new->glyphs[i].x)
+			return false;
+		if (old->glyphs[i].glyph == new->glyphs[i].glyph)
+			continue;
+
+		/* and every changed glyph, old and new, has to stay inside its
+		 * cell, or repainting a single cell would leave ink behind */
+		cx1 = new->glyphs[i].x;
+		cx2 = i + 1 < new->count ? (uint32_t)new->glyphs[i + 1].x : new->advance;
+		for (int j = 0; j < 2; ++j) {
+			glyph = j ? new->glyphs[i].glyph : old->glyphs[i].glyph;
+			if (glyph->x < 0 || glyph->x + glyph->width > (int)(cx2 - cx1)
+			    || (int)y < glyph->y || y - glyph->y + glyph->height > bar->height)
+				return false;
+		}
+	}
+
+	pixman_image_t *fg_fill = NULL;
+	for (uint32_t i = 0; i < new->count; ++i) {
+		if (old->glyphs[i].glyph == new->glyphs[i].glyph)
+			continue;
+
+		glyph = new->glyphs[i].glyph;
+		cx1 = x + new->glyphs[i].x;
+		cx2 = x + (i + 1 < new->count ? (uint32_t)new->glyphs[i + 1].x : new->advance);
+		if ((image = cell_get(glyph, color, cx2 - cx1, bar->height))) {
+			pixman_image_composite32(PIXMAN_OP_SRC, image, NULL, bar->canvas,
+					0, 0, 0, 0, cx1, 0, cx2 - cx1, bar->height);
+			pixman_region32_union_rect(&bar->damage, &bar->damage, cx1, 0, cx2 - cx1, bar->height);
+		} else {
+			if (!fg_fill)
+				fg_fill = pixman_image_create_solid_fill(&color->fg);
+			draw_background(bar, bar->canvas, cx1, cx2, &color->bg);
+			draw_glyph(bar->canvas, glyph, fg_fill, cx1, y);
+		}
+	}
+	if (fg_fill)
+		pixman_image_unref(fg_fill);
 
-	bar_free_canvas(bar, canvas, data);
+	return true;
+}
+
+void
+draw_stats_field(Bar *bar, char *drawn, size_t size, uint32_t x1, uint32_t x2,
+	uint32_t padding, Color const *color)
+{
+	/* textbuf holds the freshly formatted text */
+	if (!strncmp(drawn, textbuf, size))
+		return;
+
+	/* Usually only the last digit or two changed, so only those cells are
+	 * repainted, unless the layout of the field moved */
+	if (!*drawn || !draw_stats_cells(bar, drawn, x1, x2, padding, color)) {
+		draw_background(bar, bar->canvas, x1, x2, &color->bg);
+		if (*textbuf && x1 + padding * 2 < x2)
+			draw_glyph_run(bar, bar->canvas, glyph_run_get(&field_runs, textbuf, x2 - x1 - padding * 2),
+					x1 + padding, &color->fg);
+	}
+	snprintf(drawn, size, "%s", textbuf);
+}
+
+uint32_t
+draw_status(Bar *bar, Status *status, uint32_t x1, uint32_t x2, bool right, Color const *color)
+{
+	StatusRun const *run;
+	uint32_t x;
+
+	/* nothing drawn has no regions to click on either */
+	status->drawn = false;
+	if (!status->run_count || x1 + textpadding * 2 >= x2)
+		return x2;
+	status_layout(status, x2 - x1 - textpadding * 2);
+	if (!status->advance)
+		return x2;
+	status->drawn = true;
+
+	x = right ? x2 - textpadding - status->advance : x1 + textpadding;
+	status->x = x;
+	for (uint32_t i = 0; i < status->run_count; ++i) {
+		run = &status->runs[i];
+		if (run->has_bg)
+			draw_background(bar, bar->canvas, x + run->x, x + run->x + run->advance, &run->bg);
+		/* the same limit as in the layout, which finds the same glyph run */
+		draw_foreground(bar, bar->canvas, status->text + run->text, x + run->x,
+				x + run->x + run->limit, 0, run->has_fg ? &run->fg : &color->fg);
+	}
+	return x - textpadding;
 }
 
 void
 draw_tags(Bar *bar)
 {
-	pixman_image_t *canvas;
-	uint32_t *data, x, boxs, boxw, i;
+	uint32_t x, boxs, boxw, i;
 	bool active, occupied, urgent;
 	Color const *color;
 
-	bar_get_canvas(bar, &canvas, &data);
+	if (!bar->canvas)
+		return;
 
 	boxs = font->height / 9;
 	boxw = font->height / 6 + 2;
 	for (i = 0; i < TAGCOUNT; ++i) {
+		if (!(bar->dirty_tags & 1 << i))
+			continue;
+
 		active   = bar->mtags & 1 << i;
 		occupied = bar->ctags & 1 << i;
 		urgent   = bar->urg   & 1 << i;
+		x = draw_widths.time + draw_widths.tag * i;
+		color = tag_color(bar, i);
 
-		if (hide_vacant && !active && !occupied && !urgent)
+		if (hide_vacant && !active && !occupied && !urgent) {
+			draw_background(bar, bar->canvas, x, x + draw_widths.tag, &color->bg);
 			continue;
+		}
 
-		x = draw_widths.time + draw_widths.tag * i;
-		color = urgent ? &urgent_color : (active ? &active_color : (occupied ? &occupied_color : &inactive_color));
-		draw_background(bar, canvas, x, x + draw_widths.tag, &color->bg);
-		draw_foreground(bar, canvas, &tags[i * 2], x, x + draw_widths.tag, textpadding, &color->fg);
+		draw_background(bar, bar->canvas, x, x + draw_widths.tag, &color->bg);
+		draw_foreground(bar, bar->canvas, &tags[i * 2], x, x + draw_widths.tag, textpadding, &color->fg);
 
 		if (!hide_vacant && occupied) {
 			pixman_image_fill_boxes(PIXMAN_OP_OVER,
-					canvas, &color->fg, 1,
+					bar->canvas, &color->fg, 1,
 					&(pixman_box32_t){
 						.x1 = x + boxs, .x2 = x + boxs + boxw,
 						.y1 = boxs, .y2 = boxs + boxw
@@ -619,7 +2028,7 @@ draw_tags(Bar *bar)
 			if ((!bar->sel || !active) && boxw >= 3) {
 				/* Make box hollow */
 				pixman_image_fill_boxes(PIXMAN_OP_SRC,
-						canvas, &color->bg, 1,
+						bar->canvas, &color->bg, 1,
 						&(pixman_box32_t){
 							.x1 = x + boxs + 1, .x2 = x + boxs + boxw - 1,
 							.y1 = boxs + 1, .y2 = boxs + boxw - 1
@@ -627,38 +2036,117 @@ draw_tags(Bar *bar)
 			}
 		}
 	}
-
-	bar_free_canvas(bar, canvas, data);
+	bar->dirty_tags = 0;
 }
 
 void
 draw_window_name(Bar *bar)
 {
-	pixman_image_t *canvas;
-	uint32_t *data;
-	const uint32_t width = MIN(bar->width, draw_widths.state);
+	const uint32_t width = MIN(bar->width, draw_widths.state + draw_widths.alsa + draw_widths.date);
 	const uint32_t x = MIN(draw_widths.time + draw_widths.tag * TAGCOUNT + draw_widths.layout, bar->width - width);
 	const Color* const color = bar->sel ? &middle_sel_color : &middle_color;
+	uint32_t status_x;
 
-	bar_get_canvas(bar, &canvas, &data);
-
-	draw_background(bar, canvas, x, bar->width - width, &color->bg);
-	draw_foreground(bar, canvas, bar->window_title, x, bar->width - width, textpadding, &color->fg);
+	if (!bar->canvas)
+		return;
 
-	bar_free_canvas(bar, canvas, data);
+	draw_background(bar, bar->canvas, x, bar->width - width, &color->bg);
+	/* the status goes to the right, whatever is left is the title's */
+	status_x = draw_status(bar, &bar->status, x, bar->width - width, true, color);
+	if (bar->title.run_count)
+		draw_status(bar, &bar->title, x, status_x, false, color);
+	else
+		draw_foreground(bar, bar->canvas, bar->window_title, x, status_x, textpadding, &color->fg);
 }
 
 void
 draw_frame(Bar *bar)
 {
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, bar->shm_fd, bar->bufsize);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, bar->width, bar->height, bar->stride, WL_SHM_FORMAT_ARGB8888);
-	wl_buffer_add_listener(buffer, &wl_buffer_listener, NULL);
-	wl_shm_pool_destroy(pool);
-	wl_surface_set_buffer_scale(bar->wl_surface, buffer_scale);
-	wl_surface_attach(bar->wl_surface, buffer, 0, 0);
-	wl_surface_damage_buffer(bar->wl_surface, 0, 0, bar->width, bar->height);
-	wl_surface_commit(bar->wl_surface);
+	Buffer *buf;
+	pixman_box32_t *boxes;
+	int nboxes;
+	uint32_t width;
+	struct wl_surface *surface = bar->content ? bar->content : bar->wl_surface;
+	struct wl_buffer *background;
+	pixman_region32_t opaque;
+	struct timespec t0, t1;
+
+	scale_use(bar->scale);
+
+	/* A longer window title may not fit the buffers of a flat background
+	 * anymore, they only ever grow until the next configure */
+	if (bar->content && (width = bar_content_width(bar)) > bar->buffer_width) {
+		bar_destroy_buffers(bar);
+		bar->buffer_width = width;
+		bar->stride = bar->buffer_width * 4;
+		bar_redraw_all(bar);
+	}
+
+	/* All buffers are still held by the compositor, try again once one of
+	 * them is released */
+	if (!(buf = bar_acquire_buffer(bar)))
+		return;
+	bar->canvas = buf->canvas;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	draw_bar(bar);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	render_timings.last = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+	render_timings.total += render_timings.last;
+	render_timings.max = MAX(render_timings.max, render_timings.last);
+	++render_timings.frames;
+
+	for (uint32_t i = 0; i < bar->buffercount; ++i)
+		if (&bar->buffers[i] != buf)
+			pixman_region32_union(&bar->buffers[i].stale, &bar->buffers[i].stale, &bar->damage);
+
+	/* Ask to be told when the compositor is ready for the next frame,
+	 * until then any further changes accumulate in the redraw flags */
+	if (bar->frame_callback)
+		wl_callback_destroy(bar->frame_callback);
+	bar->frame_callback = wl_surface_frame(surface);
+	wl_callback_add_listener(bar->frame_callback, &frame_listener, bar);
+
+	if (bar->viewport)
+		wp_viewport_set_destination(bar->viewport,
+				scale_to_logical(bar->scale, bar->buffer_width),
+				scale_to_logical(bar->scale, bar->height));
+	else
+		wl_surface_set_buffer_scale(surface, bar->scale->surface_scale);
+	if (!bar->subsurface) {
+		pixman_region32_init(&opaque);
+		bar_opaque_region(bar, &opaque);
+		if (!pixman_region32_equal(&opaque, &bar->opaque)) {
+			set_opaque_region(surface, bar->scale, &opaque);
+			pixman_region32_copy(&bar->opaque, &opaque);
+		}
+		pixman_region32_fini(&opaque);
+	}
+	wl_surface_attach(surface, buf->wl_buffer, 0, 0);
+	boxes = pixman_region32_rectangles(&bar->damage, &nboxes);
+	for (int i = 0; i < nboxes; ++i)
+		wl_surface_damage_buffer(surface, boxes[i].x1, boxes[i].y1,
+				boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1);
+	wl_surface_commit(surface);
+	pixman_region32_clear(&bar->damage);
+
+	/* the bar surface itself only changes with its size or selection */
+	background = backgrounds[bar->sel ? 1 : 0];
+	if (bar->content && bar->background != background) {
+		wp_viewport_set_destination(bar->background_viewport, bar->logical_width, bar->logical_height);
+		pixman_region32_init_rect(&opaque, 0, 0, bar->width, bar->height);
+		if ((bar->sel ? &middle_sel_color : &middle_color)->bg.alpha != 0xffff)
+			pixman_region32_clear(&opaque);
+		set_opaque_region(bar->wl_surface, bar->scale, &opaque);
+		pixman_region32_fini(&opaque);
+		wl_surface_attach(bar->wl_surface, background, 0, 0);
+		wl_surface_damage_buffer(bar->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+		wl_surface_commit(bar->wl_surface);
+		bar->background = background;
+	}
+
+	buf->busy = true;
+	bar->front = buf;
+	bar->canvas = NULL;
 }
 
 void
@@ -685,8 +2173,14 @@ dwl_wm_output_active(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 {
 	Bar *bar = (Bar *)data;
 
-	if (active != bar->sel)
+	if (active != bar->sel) {
 		bar->sel = active;
+		/* the selection changes how occupied tags and the title are drawn */
+		bar->dirty_tags = (1 << TAGCOUNT) - 1;
+		bar->redraw_tags = true;
+		bar->redraw_window = true;
+		bar->changed |= ChangedSel;
+	}
 }
 
 void
@@ -694,6 +2188,7 @@ dwl_wm_output_tag(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 	uint32_t tag, uint32_t state, uint32_t clients, uint32_t focused)
 {
 	Bar *bar = (Bar *)data;
+	const uint32_t mtags = bar->mtags, ctags = bar->ctags, urg = bar->urg;
 
 	if (state & ZDWL_IPC_OUTPUT_V2_TAG_STATE_ACTIVE)
 		bar->mtags |= 1 << tag;
@@ -708,7 +2203,11 @@ dwl_wm_output_tag(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 	else
 		bar->urg &= ~(1 << tag);
 
-	bar->redraw_tags = true;
+	if (mtags != bar->mtags || ctags != bar->ctags || urg != bar->urg) {
+		bar->dirty_tags |= 1 << tag;
+		bar->redraw_tags = true;
+		bar->changed |= ChangedTags;
+	}
 }
 
 void
@@ -717,6 +2216,8 @@ dwl_wm_output_layout(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 {
 	Bar *bar = (Bar *)data;
 
+	if (layout != bar->layout_idx)
+		bar->changed |= ChangedLayout;
 	bar->last_layout_idx = bar->layout_idx;
 	bar->layout_idx = layout;
 	bar->redraw_layout = true;
@@ -729,6 +2230,8 @@ dwl_wm_output_title(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 	Bar *bar;
 
 	bar = (Bar *)data;
+	if (!bar->window_title || strcmp(bar->window_title, title))
+		bar->changed |= ChangedTitle;
 	if (bar->window_title)
 		free(bar->window_title);
 	if (!(bar->window_title = strdup(title)))
@@ -755,16 +2258,33 @@ void
 dwl_wm_output_frame(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output)
 {
 	Bar *bar = (Bar *)data;
-	if (bar->redraw_tags)   draw_tags(bar);
-	if (bar->redraw_window) draw_window_name(bar);
-	if (bar->redraw_layout) draw_layout(bar);
-	bar->redraw = bar->redraw_tags | bar->redraw_window | bar->redraw_layout;
+	Client *client, *tmp;
+
+	bar->redraw |= bar->redraw_tags | bar->redraw_window | bar->redraw_layout;
+
+	/* everything dwl changed at once makes a single event */
+	if (!bar->changed)
+		return;
+	wl_list_for_each_safe(client, tmp, &clients, link) {
+		if (!client->subscribed)
+			continue;
+		subscriber_event(client, bar, bar->changed);
+		/* not reading at all, rather than just slow */
+		if (client->lag > SUBSCRIBER_LAG_MAX)
+			client_close(client);
+	}
+	bar->changed = 0;
 }
 
 void
 dwl_wm_output_fullscreen(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 	uint32_t is_fullscreen)
 {
+	Bar *bar = (Bar *)data;
+
+	/* Changes keep piling up in the redraw flags while the bar is covered
+	 * and are drawn once it can be seen again */
+	bar->fullscreen = is_fullscreen;
 }
 
 void
@@ -784,69 +2304,80 @@ dwl_wm_tags(void *data, struct zdwl_ipc_manager_v2 *dwl_wm,
 void
 event_loop(void)
 {
-	const int wl_fd = wl_display_get_fd(display);
-	const int tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
-	const struct itimerspec spec = {
-		{ 1, 0 },
-		{ 1, 0 },
-	};
-	timerfd_settime(tfd, 0, &spec, NULL);
+	struct epoll_event events[16];
+	Bar *bar;
+	bool alsa;
+	int count;
 
-	char buf[8];
 	while (run_display) {
 		wl_display_flush(display);
 
-		int fd_count = snd_mixer_poll_descriptors_count(stats.mixer);
-		struct pollfd fds[fd_count + 3];
-		fds[0] = (struct pollfd) { .fd = wl_fd,   .events = POLLIN };
-        fds[1] = (struct pollfd) { .fd = sock_fd, .events = POLLIN };
-        fds[2] = (struct pollfd) { .fd = tfd,     .events = POLLIN };
-		snd_mixer_poll_descriptors(stats.mixer, &fds[3], fd_count);
-
-		if (poll(fds, fd_count + 3, -1) == -1) {
+		if ((count = epoll_wait(epoll_fd, events, LENGTH(events), -1)) == -1) {
 			if (errno == EINTR)
 				continue;
 			else
-				die("poll:");
+				die("epoll_wait:");
 		}
 
-		if (fds[0].revents) {
-			if (wl_display_dispatch(display) == -1)
+		alsa = false;
+		for (int i = 0; i < count; ++i) {
+			switch ((uint32_t)events[i].data.u64) {
+			case EventWayland:
+				if (wl_display_dispatch(display) == -1)
+					return;
 				break;
-		}
-
-		if (fds[1].revents)
-			read_socket();
-
-		Bar *bar;
-		if (fds[2].revents) {
-			read(tfd, buf, 8);
-			stats_update();
-		}
-
-		for (int i = 0; i < fd_count; ++i) {
-			if (fds[3 + i].revents & POLLIN) {
-				snd_mixer_handle_events(stats.mixer);
-				wl_list_for_each(bar, &bar_list, link) {
-					draw_alsa(bar);
-					bar->redraw = true;
+			case EventSocket:
+				read_socket();
+				break;
+			case EventStats:
+				stats_handle_update();
+				break;
+			case EventAlsa:
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+					die("disconnected from alsa");
+				alsa = true;
+				break;
+			case EventChild:
+				reap_child(events[i].data.u64 >> 32);
+				break;
+			case EventClient: {
+				Client *client;
+				wl_list_for_each(client, &clients, link) {
+					if (client->fd != (int)(events[i].data.u64 >> 32))
+						continue;
+					if ((events[i].events & EPOLLOUT) && !client_flush(client))
+						break;
+					/* a query put off for want of room goes on
+					 * once some of the ring is sent */
+					if (events[i].events & ~EPOLLOUT || client->deferred)
+						client_read(client);
+					break;
 				}
 				break;
-			} else if (fds[3 + i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
-				die("disconnected from alsa");
+			}
 			}
 		}
 
+		/* however many mixer descriptors woke us up, handle them once */
+		if (alsa)
+			alsa_handle_events();
+
+		/* At most one frame is in flight per surface, and widgets are
+		 * committed on their own */
+		bool visible = false;
 		wl_list_for_each(bar, &bar_list, link) {
-			if (bar->redraw) {
-				if (!bar->hidden)
-					draw_frame(bar);
-				bar->redraw = false;
-				bar->redraw_tags = false;
-				bar->redraw_layout = false;
-				bar->redraw_window = false;
-			}
+			if (!bar_visible(bar))
+				continue;
+			visible = true;
+			for (int i = 0; i < WidgetCount; ++i)
+				if (bar->widgets[i] && bar->widgets[i]->redraw && !bar->widgets[i]->frame_callback)
+					draw_frame(bar->widgets[i]);
+			if (bar->redraw && !bar->frame_callback)
+				draw_frame(bar);
 		}
+
+		/* nothing is sampled while no bar can be seen */
+		stats_timer_arm(visible);
 	}
 }
 
@@ -868,12 +2399,149 @@ expand_shm_file(Bar* bar, size_t size)
 	}
 }
 
+void
+fractional_scale_preferred(void *data, struct wp_fractional_scale_v1 *fractional_scale, uint32_t value)
+{
+	Bar *bar = (Bar *)data;
+	Scale *scale = scale_get(value);
+
+	if (scale == bar->scale)
+		return;
+	bar->scale = scale;
+
+	/* the fields, and the widgets showing them, are sized by the scale */
+	teardown_widgets(bar);
+	setup_widgets(bar);
+
+	/* the font decides the height of the bar, which may round differently
+	 * at this scale; the configure that follows redraws the bar */
+	if (scale->logical_height != bar->logical_height) {
+		zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, scale->logical_height);
+		zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, scale->logical_height);
+		wl_surface_commit(bar->wl_surface);
+	} else if (bar->configured) {
+		bar_resize(bar);
+	}
+}
+
+void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	Bar *bar = (Bar *)data;
+
+	wl_callback_destroy(callback);
+	bar->frame_callback = NULL;
+}
+
+GlyphRun const *
+glyph_run_get(GlyphCache *cache, char const *text, uint32_t limit)
+{
+	GlyphRun *run;
+	char const *p;
+	uint32_t hash = 2166136261u;
+	size_t len;
+
+	/* FNV-1a */
+	for (p = text; *p; ++p)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	len = p - text;
+
+	wl_list_for_each(run, &cache->runs, link) {
+		if (run->hash == hash && run->limit == limit && run->font == font && !strcmp(run->text, text)) {
+			wl_list_remove(&run->link);
+			wl_list_insert(&cache->runs, &run->link);
+			return run;
+		}
+	}
+
+	if (cache->count < cache->size) {
+		if (!(run = calloc(1, sizeof(GlyphRun))))
+			die("calloc:");
+		++cache->count;
+	} else {
+		run = wl_container_of(cache->runs.prev, run, link);
+		wl_list_remove(&run->link);
+		free(run->text);
+	}
+
+	if (!(run->text = strdup(text)))
+		die("strdup:");
+	run->hash = hash;
+	run->font = font;
+	run->limit = limit;
+	/* there are never more glyphs than bytes */
+	if (!(run->glyphs = realloc(run->glyphs, (len + 1) * sizeof(PlacedGlyph))))
+		die("realloc:");
+
+	uint32_t codepoint, state = UTF8_ACCEPT, last_cp = 0;
+	long x = 0;
+	run->count = 0;
+	for (p = text; *p; p++) {
+		/* Returns nonzero if more bytes are needed */
+		if (utf8decode(&state, &codepoint, *p))
+			continue;
+
+		/* Turn off subpixel rendering, which complicates things when
+		 * mixed with alpha channels */
+		const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
+		if (!glyph)
+			continue;
+
+		/* Adjust x position based on kerning with previous glyph */
+		long kern = 0;
+		if (last_cp)
+			fcft_kerning(font, last_cp, codepoint, &kern, NULL);
+		if (x + kern + glyph->advance.x > limit)
+			break;
+		last_cp = codepoint;
+		x += kern;
+
+		run->glyphs[run->count].glyph = glyph;
+		run->glyphs[run->count].x = x;
+		++run->count;
+
+		/* increment pen position */
+		x += glyph->advance.x;
+	}
+	run->advance = x;
+
+	wl_list_insert(&cache->runs, &run->link);
+	return run;
+}
+
+void
+glyph_runs_clear(void)
+{
+	GlyphCache *caches[] = { &text_runs, &field_runs };
+	GlyphRun *run, *tmp;
+
+	for (size_t i = 0; i < LENGTH(caches); ++i) {
+		wl_list_for_each_safe(run, tmp, &caches[i]->runs, link) {
+			wl_list_remove(&run->link);
+			free(run->text);
+			free(run->glyphs);
+			free(run);
+		}
+		caches[i]->count = 0;
+	}
+}
+
 void
 handle_global(void *data, struct wl_registry *registry,
 	      uint32_t name, const char *interface, uint32_t version)
 {
 	if (!strcmp(interface, wl_compositor_interface.name)) {
 		compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+	} else if (!strcmp(interface, wl_subcompositor_interface.name)) {
+		subcompositor = wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+	} else if (!strcmp(interface, wp_viewporter_interface.name)) {
+		viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+	} else if (!strcmp(interface, wp_fractional_scale_manager_v1_interface.name)) {
+		fractional_scale_manager = wl_registry_bind(registry, name,
+				&wp_fractional_scale_manager_v1_interface, 1);
+	} else if (!strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name)) {
+		single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
 	} else if (!strcmp(interface, wl_shm_interface.name)) {
 		shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
 	} else if (!strcmp(interface, zwlr_layer_shell_v1_interface.name)) {
@@ -897,7 +2565,7 @@ handle_global(void *data, struct wl_registry *registry,
 		if (!seat)
 			die("calloc:");
 		seat->registry_name = name;
-		seat->wl_seat = wl_registry_bind(registry, name, &wl_seat_interface, 7);
+		seat->wl_seat = wl_registry_bind(registry, name, &wl_seat_interface, MIN(version, 8));
 		wl_seat_add_listener(seat->wl_seat, &seat_listener, seat);
 		wl_list_insert(&seat_list, &seat->link);
 	}
@@ -928,9 +2596,29 @@ handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 void
 hide_bar(Bar *bar)
 {
+	if (bar->frame_callback) {
+		wl_callback_destroy(bar->frame_callback);
+		bar->frame_callback = NULL;
+	}
+	teardown_widgets(bar);
+	if (bar->viewport) {
+		wp_viewport_destroy(bar->viewport);
+		bar->viewport = NULL;
+	}
+	if (bar->fractional_scale) {
+		wp_fractional_scale_v1_destroy(bar->fractional_scale);
+		bar->fractional_scale = NULL;
+	}
+	teardown_content(bar);
 	zwlr_layer_surface_v1_destroy(bar->layer_surface);
 	wl_surface_destroy(bar->wl_surface);
 
+	/* the compositor is not required to release buffers of a destroyed
+	 * surface, so start over with fresh ones on the next configure */
+	bar_destroy_buffers(bar);
+	bar->width = 0;
+	pixman_region32_clear(&bar->opaque);
+
 	bar->configured = false;
 	bar->hidden = true;
 }
@@ -940,41 +2628,18 @@ void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 			uint32_t serial, uint32_t w, uint32_t h)
 {
-	uint32_t *canvas_data;
-	pixman_image_t *canvas;
 	Bar *bar;
 
-	w = w * buffer_scale;
-	h = h * buffer_scale;
-
 	zwlr_layer_surface_v1_ack_configure(surface, serial);
 
 	bar = (Bar *)data;
 
-	if (bar->configured && w == bar->width && h == bar->height)
+	if (bar->configured && w == bar->logical_width && h == bar->logical_height)
 		return;
 
-	bar->width = w;
-	bar->height = h;
-	bar->stride = bar->width * 4;
-	expand_shm_file(bar, bar->stride * bar->height);
-
-	bar_get_canvas(bar, &canvas, &canvas_data);
-	draw_background(
-			bar,
-			canvas,
-			draw_widths.time,
-			bar->width - draw_widths.state,
-			bar->sel ? &middle_sel_color.bg : &middle_color.bg);
-	bar_free_canvas(bar, canvas, canvas_data);
-	bar->configured = true;
-
-	draw_alsa(bar);
-	draw_tags(bar);
-	draw_layout(bar);
-	draw_window_name(bar);
-	draw_stats(bar);
-	draw_frame(bar);
+	bar->logical_width = w;
+	bar->logical_height = h;
+	bar_resize(bar);
 }
 
 void
@@ -1016,6 +2681,30 @@ output_logical_position(void *data, struct zxdg_output_v1 *xdg_output,
 {
 }
 
+bool
+parse_color(char const *text, char const *end, pixman_color_t *color)
+{
+	uint32_t hex = 0;
+	char const *p;
+
+	/* RRGGBB or RRGGBBAA, anything else meaning the default color */
+	if (end - text != 6 && end - text != 8)
+		return false;
+	for (p = text; p < end; ++p) {
+		if (*p >= '0' && *p <= '9')
+			hex = hex << 4 | (*p - '0');
+		else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+			hex = hex << 4 | ((*p | 0x20) - 'a' + 10);
+		else
+			return false;
+	}
+	if (end - text == 6)
+		hex = hex << 8 | 0xff;
+
+	*color = (pixman_color_t)HEX_COLOR(hex);
+	return true;
+}
+
 uint64_t
 parse_trusted_uint64_t(char const** const cur)
 {
@@ -1042,27 +2731,39 @@ void
 pointer_axis_discrete(void *data, struct wl_pointer *pointer,
 		      uint32_t axis, int32_t discrete)
 {
-	uint32_t vol_x1, mic_x1, mic_x2;
-	Seat *seat = (Seat *)data;
-	if (!seat->bar)
-		return;
+	/* only sent by seats older than version 8 */
+	pointer_scroll((Seat *)data, discrete * 120);
+}
 
-	mic_x2 = (seat->bar->width - draw_widths.date) / buffer_scale;
-	mic_x1 = mic_x2 - draw_widths.mic / buffer_scale;
-	vol_x1 = mic_x2 - draw_widths.alsa / buffer_scale;
-	if (seat->pointer_x >= vol_x1 && seat->pointer_x <= mic_x2) {
-		if (seat->pointer_x > mic_x1) {
-			if (discrete < 0)
-				shell_command(mic_up_cmd);
-			else
-				shell_command(mic_down_cmd);
-		} else {
-			if (discrete < 0)
-				shell_command(vol_up_cmd);
-			else
-				shell_command(vol_down_cmd);
-		}
+void
+pointer_scroll(Seat *seat, int32_t value120)
+{
+	uint32_t vol_x1, mic_x1, mic_x2, title_x, right_x;
+	snd_mixer_elem_t *elem = NULL;
+	bool status = false;
+
+	if (seat->bar) {
+		scale_use(seat->bar->scale);
+		mic_x2 = scale_to_logical(seat->bar->scale, seat->bar->width - draw_widths.date);
+		mic_x1 = mic_x2 - scale_to_logical(seat->bar->scale, draw_widths.mic);
+		vol_x1 = mic_x2 - scale_to_logical(seat->bar->scale, draw_widths.alsa);
+		right_x = scale_to_logical(seat->bar->scale, seat->bar->width
+				- MIN(seat->bar->width, draw_widths.state + draw_widths.alsa + draw_widths.date));
+		title_x = MIN(scale_to_logical(seat->bar->scale, draw_widths.time + draw_widths.tag * TAGCOUNT
+				+ draw_widths.layout), right_x);
+		if (seat->pointer_x >= vol_x1 && seat->pointer_x <= mic_x2)
+			elem = seat->pointer_x > mic_x1 ? stats.capture : stats.playback;
+		else if (seat->pointer_x >= title_x && seat->pointer_x < right_x)
+			status = seat->bar->status.button_count || seat->bar->title.button_count;
 	}
+
+	/* motion left over from another field does not carry over */
+	if (elem != seat->scroll_elem || status != seat->scroll_status)
+		seat->scroll120 = 0;
+	seat->scroll_elem = elem;
+	seat->scroll_status = status;
+	if (elem || status)
+		seat->scroll120 += value120;
 }
 
 void
@@ -1081,6 +2782,7 @@ void
 pointer_axis_value120(void *data, struct wl_pointer *pointer,
 		      uint32_t axis, int32_t discrete)
 {
+	pointer_scroll((Seat *)data, discrete);
 }
 
 
@@ -1133,11 +2835,36 @@ pointer_frame(void *data, struct wl_pointer *pointer)
 {
 	Seat *seat = (Seat *)data;
 
+	/* Whole notches scrolled within this frame, with the rest of a high
+	 * resolution wheel kept for the next one. Scrolling up turns it up. */
+	if (seat->scroll120 / 120) {
+		const int32_t notches = seat->scroll120 / 120;
+		seat->scroll120 %= 120;
+		if (seat->scroll_status) {
+			const uint32_t button = notches < 0 ? StatusScrollUp : StatusScrollDown;
+			const uint32_t x = seat->bar ? scale_from_logical(seat->bar->scale, seat->pointer_x) : 0;
+			for (int32_t i = 0; seat->bar && i < abs(notches); ++i)
+				if (!status_click(&seat->bar->status, x, button))
+					status_click(&seat->bar->title, x, button);
+		} else if (volume_in_process) {
+			alsa_adjust(seat->scroll_elem, -notches * volume_step);
+		} else {
+			const bool mic = seat->scroll_elem == stats.capture;
+			for (int32_t i = 0; i < abs(notches); ++i) {
+				if (notches < 0)
+					shell_command(mic ? mic_up_cmd : vol_up_cmd);
+				else
+					shell_command(mic ? mic_down_cmd : vol_down_cmd);
+			}
+		}
+	}
+
 	if (!seat->pointer_button || !seat->bar)
 		return;
 
 	uint32_t x = 0, i = 0;
-	x += draw_widths.time / buffer_scale;
+	scale_use(seat->bar->scale);
+	x += scale_to_logical(seat->bar->scale, draw_widths.time);
 	do {
 		if (hide_vacant) {
 			const bool active = seat->bar->mtags & 1 << i;
@@ -1146,7 +2873,7 @@ pointer_frame(void *data, struct wl_pointer *pointer)
 			if (!active && !occupied && !urgent)
 				continue;
 		}
-		x += draw_widths.tag / buffer_scale;
+		x += scale_to_logical(seat->bar->scale, draw_widths.tag);
 	} while (seat->pointer_x >= x && ++i < TAGCOUNT);
 
 	if (i < TAGCOUNT) {
@@ -1157,26 +2884,18 @@ pointer_frame(void *data, struct wl_pointer *pointer)
 			zdwl_ipc_output_v2_set_tags(seat->bar->dwl_wm_output, ~0, 1);
 		else if (seat->pointer_button == BTN_RIGHT)
 			zdwl_ipc_output_v2_set_tags(seat->bar->dwl_wm_output, seat->bar->mtags ^ (1 << i), 0);
-	} else if (seat->pointer_x < (x += draw_widths.layout)) {
+	} else if (seat->pointer_x < (x += scale_to_logical(seat->bar->scale, draw_widths.layout))) {
 		/* Clicked on layout */
 		if (seat->pointer_button == BTN_LEFT)
 			zdwl_ipc_output_v2_set_layout(seat->bar->dwl_wm_output, seat->bar->last_layout_idx);
 		else if (seat->pointer_button == BTN_RIGHT)
 			zdwl_ipc_output_v2_set_layout(seat->bar->dwl_wm_output, 2);
 	} else {
-		uint32_t status_x = MAX(x, seat->bar->width - draw_widths.state) / buffer_scale;
-		if (seat->pointer_x >= status_x) {
-			//TODO
-			/* Clicked on status */
-			/*for (i = 0; i < seat->bar->status.buttons_l; i++) {
-				if (seat->pointer_button == seat->bar->status.buttons[i].btn
-				    && seat->pointer_x >= status_x + textpadding + seat->bar->status.buttons[i].x1 / buffer_scale
-				    && seat->pointer_x < status_x + textpadding + seat->bar->status.buttons[i].x2 / buffer_scale) {
-					shell_command(seat->bar->status.buttons[i].command);
-					break;
-				}
-			}*/
-		}
+		/* Clicked on the title area, the status drawn in it, or the
+		 * fields to its right which have no regions */
+		const uint32_t status_x = scale_from_logical(seat->bar->scale, seat->pointer_x);
+		if (!status_click(&seat->bar->status, status_x, seat->pointer_button))
+			status_click(&seat->bar->title, status_x, seat->pointer_button);
 	}
 
 	seat->pointer_button = 0;
@@ -1223,19 +2942,79 @@ static IOPrint print_io(uint64_t io_value) {
 void
 read_socket(void)
 {
-	int cli_fd;
-	if ((cli_fd = accept(sock_fd, NULL, 0)) == -1)
-		die("accept:");
-	ssize_t len = recv(cli_fd, sockbuf, sizeof sockbuf - 1, 0);
-	if (len == -1)
-		die("recv:");
-	close(cli_fd);
-	if (len == 0)
-		return;
-	sockbuf[len] = '\0';
+	Client *client;
+	int fd;
+
+	/* accept the whole backlog, every connection being read right away as
+	 * most clients have sent all they had by now */
+	for (;;) {
+		if ((fd = accept4(sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			if ((errno != EMFILE && errno != ENFILE) || spare_fd == -1)
+				break;
+			/* Out of descriptors, the connection would stay pending
+			 * and wake the loop over and over. The spare one makes
+			 * room to take it off the backlog and drop it. */
+			fprintf(stderr, "accept: %s, dropping a connection\n", strerror(errno));
+			close(spare_fd);
+			fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd != -1)
+				close(fd);
+			spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (fd == -1)
+				break;
+			continue;
+		}
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT(EventClient, fd) };
+		if (!(client = calloc(1, sizeof *client))) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			close(fd);
+			free(client);
+			continue;
+		}
+		wl_list_insert(&clients, &client->link);
+		client_read(client);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		fprintf(stderr, "accept: %s\n", strerror(errno));
+}
+
+void
+reap_child(int pidfd)
+{
+	/* Reap every command that is done, including any started while no
+	 * pidfd could be had; the pidfds of those reaped early still turn
+	 * readable and end up here to be closed. */
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pidfd, NULL);
+	close(pidfd);
+}
+
+void
+run_command(Client *client, char *command)
+{
+	enum Command cmd = command[0];
+	char *output = command + 1, *text = NULL;
 
-	enum Command cmd = sockbuf[0];
-	char *output = sockbuf + 1;
+	if (cmd == CommandSubscribe) {
+		subscriber_add(client, output);
+		return;
+	}
+	/* the text follows the output name, which has no spaces */
+	if (cmd == CommandStatus || cmd == CommandTitle) {
+		if ((text = strchr(output, ' ')))
+			*text++ = '\0';
+		else
+			text = "";
+		/* what is left of text split over several lines */
+		for (char const *c = text; *c; ++c)
+			if ((unsigned char)*c < ' ' || *c == 0x7f)
+				return;
+	}
 
 	Bar *bar = NULL, *it;
 	bool all = false;
@@ -1336,9 +3115,117 @@ read_socket(void)
 		}
 		break;
 	}
+	case CommandStatus: {
+		if (all) {
+			wl_list_for_each(bar, &bar_list, link)
+				status_set(bar, &bar->status, text);
+		} else {
+			status_set(bar, &bar->status, text);
+		}
+		break;
+	}
+	case CommandTitle: {
+		if (all) {
+			wl_list_for_each(bar, &bar_list, link)
+				status_set(bar, &bar->title, text);
+		} else {
+			status_set(bar, &bar->title, text);
+		}
+		break;
+	}
+	case CommandSubscribe:
+		break;
     }
 }
 
+bool
+run_frame(Client *client, FrameHeader const *header, char const *payload)
+{
+	static char reply[sizeof(FrameHeader) + FRAME_PAYLOAD_MAX];
+	FrameHeader *out = (FrameHeader *)reply;
+	size_t len = sizeof *out;
+	char command[2 + FRAME_PAYLOAD_MAX];
+	BatchEntry entry;
+	Snapshot const *snap;
+	Bar *bar;
+
+	*out = (FrameHeader){
+		.magic = FRAME_MAGIC,
+		.version = FRAME_VERSION,
+		.opcode = header->opcode | OPCODE_REPLY,
+	};
+
+	switch (header->version == FRAME_VERSION ? header->opcode : OpcodeError) {
+	case OpcodeBatch:
+		/* each entry runs just like the text command it stands for */
+		for (uint32_t i = 0; i + sizeof entry <= header->length; i += entry.length) {
+			memcpy(&entry, payload + i, sizeof entry);
+			i += sizeof entry;
+			if (entry.length > header->length - i)
+				return false;
+			command[0] = entry.command;
+			memcpy(command + 1, payload + i, entry.length);
+			command[1 + entry.length] = '\0';
+			run_command(client, command);
+		}
+		return true;
+	case OpcodeQueryBars:
+		wl_list_for_each(bar, &bar_list, link) {
+			char const *name = bar->xdg_output_name ? bar->xdg_output_name : "";
+			char const *title = bar->window_title ? bar->window_title : "";
+			BarState state = {
+				.mtags = bar->mtags,
+				.ctags = bar->ctags,
+				.urg = bar->urg,
+				.layout_idx = bar->layout_idx,
+				.sel = bar->sel,
+				.hidden = bar->hidden,
+				.bottom = bar->bottom,
+				.fullscreen = bar->fullscreen,
+				.name_length = MIN(strlen(name), 255),
+				.title_length = MIN(strlen(title), 1023),
+			};
+			if (len + sizeof state + state.name_length + state.title_length > sizeof reply)
+				break;
+			memcpy(reply + len, &state, sizeof state);
+			len += sizeof state;
+			memcpy(reply + len, name, state.name_length);
+			len += state.name_length;
+			memcpy(reply + len, title, state.title_length);
+			len += state.title_length;
+		}
+		break;
+	case OpcodeQueryStats: {
+		snap = &stats.slots[stats.front];
+		const StatsState state = {
+			.cpu_usage = snap->cpu_usage,
+			.mem_usage = snap->mem_usage,
+			.gpu_temperature = snap->gpu_temperature,
+			.playback_volume = stats.playback_volume,
+			.capture_volume = stats.capture_volume,
+			.disk_read = snap->disk_read,
+			.disk_written = snap->disk_written,
+			.net_rx = snap->net_rx,
+			.net_tx = snap->net_tx,
+		};
+		memcpy(reply + len, &state, sizeof state);
+		len += sizeof state;
+		break;
+	}
+	case OpcodeQueryTimings:
+		memcpy(reply + len, &render_timings, sizeof render_timings);
+		len += sizeof render_timings;
+		break;
+	default:
+		out->opcode = OpcodeError | OPCODE_REPLY;
+		break;
+	}
+
+	/* a client that does not read its replies is not worth keeping */
+	out->length = len - sizeof *out;
+	return client_queue(client, reply, len);
+}
+
 void
 seat_capabilities(void *data, struct wl_seat *wl_seat,
 		  uint32_t capabilities)
@@ -1363,8 +3250,11 @@ seat_name(void *data, struct wl_seat *wl_seat, const char *name)
 void
 setup_bar(Bar *bar)
 {
-	bar->height = height * buffer_scale;
+	bar->scale = scale_get(buffer_scale * 120);
 	bar->bottom = bottom;
+	pixman_region32_init(&bar->damage);
+	pixman_region32_init(&bar->shared);
+	pixman_region32_init(&bar->opaque);
 	bar->hidden = hidden;
 
 	bar->xdg_output = zxdg_output_manager_v1_get_xdg_output(output_manager, bar->wl_output);
@@ -1383,6 +3273,49 @@ setup_bar(Bar *bar)
 	bar->shm_fd = create_shm_file();
 }
 
+void
+setup_content(Bar *bar)
+{
+	struct wl_region *region;
+
+	if (!backgrounds[0])
+		return;
+
+	bar->background_viewport = wp_viewporter_get_viewport(viewporter, bar->wl_surface);
+	if (!bar->background_viewport)
+		die("Could not create wp_viewport");
+	bar->content = wl_compositor_create_surface(compositor);
+	if (!bar->content)
+		die("Could not create wl_surface");
+	bar->content_subsurface = wl_subcompositor_get_subsurface(subcompositor, bar->content, bar->wl_surface);
+	if (!bar->content_subsurface)
+		die("Could not create wl_subsurface");
+	wl_subsurface_set_desync(bar->content_subsurface);
+
+	/* clicks and scrolling go to the bar, which covers the whole output
+	 * width */
+	region = wl_compositor_create_region(compositor);
+	wl_surface_set_input_region(bar->content, region);
+	wl_region_destroy(region);
+}
+
+void
+setup_draw_widths(void)
+{
+	snprintf(textbuf, 256, bar_time_fmt, '0', '0', '0');
+	draw_widths.time = text_width(textbuf, 0xFFFFFFFFu, textpadding / 2);
+	snprintf(textbuf, 256, bar_date_fmt, '0', '0', '0');
+	draw_widths.date = text_width(textbuf, 0xFFFFFFFFu, textpadding / 2);
+	snprintf(textbuf, 256, bar_state_fmt, "0", "0", "0", "0", '0', '0', '0');
+	draw_widths.state =  text_width(textbuf, 0xFFFFFFFFu, textpadding);
+	draw_widths.tag =    text_width("0",     0xFFFFFFFFu, textpadding);
+	draw_widths.layout = text_width("000",   0xFFFFFFFFu, textpadding);
+	snprintf(textbuf, 256, bar_alsa_fmt, 0, 0);
+	draw_widths.alsa = text_width(textbuf, 0xFFFFFFFFu, textpadding / 2);
+	draw_widths.mic = text_width("100% ", 0xFFFFFFFFu, textpadding / 2);
+}
+
+
 void
 set_top(Bar *bar)
 {
@@ -1409,14 +3342,268 @@ set_bottom(Bar *bar)
 	bar->bottom = true;
 }
 
+void
+setup_tile(Scale *scale)
+{
+	/* widgets are copied from the tile as well */
+	if (!shared_fields && !widget_subsurfaces && !backgrounds[0])
+		return;
+
+	scale->tile.width = draw_widths.time + draw_widths.state + draw_widths.alsa + draw_widths.date;
+	scale->tile.height = scale->height;
+	if (!(scale->tile.canvas = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+			scale->tile.width, scale->tile.height, NULL, 0)))
+		die("Could not create shared tile");
+	pixman_region32_init(&scale->tile.damage);
+
+	/* bars only take the tile over once they are at this scale, and then
+	 * they copy all of it */
+	draw_alsa(&scale->tile);
+	draw_stats(&scale->tile);
+	pixman_region32_clear(&scale->tile.damage);
+}
+
+void
+setup_widgets(Bar *bar)
+{
+	Bar *widget;
+
+	scale_use(bar->scale);
+
+	/* A flat background leaves no buffer under the fields on the right, so
+	 * all of them, the date included, become widgets. Their content comes
+	 * from the tile, so a bar that does not show it has none. */
+	if (!(widget_subsurfaces || backgrounds[0]) || !subcompositor || !tile->canvas
+	    || !bar_shares_tile(bar))
+		return;
+
+	const uint32_t tile_x[WidgetCount] = {
+		[WidgetTime] = 0,
+		[WidgetState] = draw_widths.time,
+		[WidgetAlsa] = draw_widths.time + draw_widths.state,
+		[WidgetDate] = draw_widths.time + draw_widths.state + draw_widths.alsa,
+	};
+	const uint32_t width[WidgetCount] = {
+		[WidgetTime] = draw_widths.time,
+		[WidgetState] = draw_widths.state,
+		[WidgetAlsa] = draw_widths.alsa,
+		[WidgetDate] = draw_widths.date,
+	};
+	Color const * const colors[WidgetCount] = {
+		[WidgetTime] = &time_color,
+		[WidgetState] = &inactive_color,
+		[WidgetAlsa] = &inactive_color,
+		[WidgetDate] = &active_color,
+	};
+
+	for (int i = 0; i < (backgrounds[0] ? WidgetCount : WidgetDate); ++i) {
+		if (!(widget = calloc(1, sizeof(Bar))))
+			die("calloc:");
+		widget->wl_surface = wl_compositor_create_surface(compositor);
+		if (!widget->wl_surface)
+			die("Could not create wl_surface");
+		widget->subsurface = wl_subcompositor_get_subsurface(subcompositor, widget->wl_surface, bar->wl_surface);
+		if (!widget->subsurface)
+			die("Could not create wl_subsurface");
+		/* commits of a widget show up right away instead of waiting for
+		 * the next commit of the bar */
+		wl_subsurface_set_desync(widget->subsurface);
+		/* clicks and scrolling go through to the bar below */
+		struct wl_region *region = wl_compositor_create_region(compositor);
+		wl_surface_set_input_region(widget->wl_surface, region);
+		wl_region_destroy(region);
+		if (bar->viewport)
+			widget->viewport = wp_viewporter_get_viewport(viewporter, widget->wl_surface);
+
+		widget->scale = bar->scale;
+		widget->tile_x = tile_x[i];
+		widget->width = width[i];
+		widget->buffer_width = widget->width;
+		widget->height = tile->height;
+
+		/* a widget is a single field in a single color */
+		pixman_region32_init(&widget->opaque);
+		if (colors[i]->bg.alpha == 0xffff)
+			pixman_region32_union_rect(&widget->opaque, &widget->opaque, 0, 0, widget->width, widget->height);
+		set_opaque_region(widget->wl_surface, widget->scale, &widget->opaque);
+		widget->stride = widget->buffer_width * 4;
+		pixman_region32_init(&widget->damage);
+		pixman_region32_init(&widget->shared);
+		widget->shm_fd = create_shm_file();
+		bar->widgets[i] = widget;
+	}
+}
+
+uint32_t
+scale_from_logical(Scale const *scale, uint32_t logical)
+{
+	return (logical * scale->scale + 60) / 120;
+}
+
+Scale *
+scale_get(uint32_t value)
+{
+	Scale *scale;
+
+	wl_list_for_each(scale, &scales, link)
+		if (scale->scale == value)
+			return scale;
+
+	if (!(scale = calloc(1, sizeof(Scale))))
+		die("calloc:");
+	scale->scale = value;
+	/* without fractional scaling, surfaces only scale by whole numbers */
+	scale->surface_scale = fractional_scale_manager && viewporter ? 1 : MAX(value / 120, 1);
+
+	snprintf(textbuf, 256, "dpi=%.2f", 96.0 * value / 120);
+	if (!(scale->font = fcft_from_name(FONTCOUNT, fontstr, textbuf)))
+		die("Could not load font");
+	scale->textpadding = (scale->font->height * 2) / 5;
+	scale->logical_height = scale->font->height * 120 / value + vertical_padding * 2;
+	scale->height = scale_from_logical(scale, scale->logical_height);
+	wl_list_insert(&scales, &scale->link);
+
+	scale_use(scale);
+	setup_draw_widths();
+	/* The fields that may become widgets, and with them the tile, take a
+	 * whole number of surface pixels, which their buffers and positions
+	 * have to be */
+	uint32_t *fields[] = { &draw_widths.time, &draw_widths.state, &draw_widths.alsa, &draw_widths.date };
+	for (size_t i = 0; i < LENGTH(fields); ++i)
+		*fields[i] = (*fields[i] + scale->surface_scale - 1) / scale->surface_scale * scale->surface_scale;
+	scale->draw_widths = draw_widths;
+	setup_tile(scale);
+
+	return scale;
+}
+
+uint32_t
+scale_to_logical(Scale const *scale, uint32_t pixels)
+{
+	return (pixels * 120 + scale->scale / 2) / scale->scale;
+}
+
+void
+scale_use(Scale const *scale)
+{
+	font = scale->font;
+	textpadding = scale->textpadding;
+	draw_widths = scale->draw_widths;
+	tile = (Bar *)&scale->tile;
+}
+
+void
+scales_clear(void)
+{
+	Scale *scale, *tmp;
+
+	wl_list_for_each_safe(scale, tmp, &scales, link) {
+		if (scale->tile.canvas) {
+			pixman_image_unref(scale->tile.canvas);
+			pixman_region32_fini(&scale->tile.damage);
+		}
+		fcft_destroy(scale->font);
+		wl_list_remove(&scale->link);
+		free(scale);
+	}
+	font = NULL;
+	tile = NULL;
+}
+
+void
+set_opaque_region(struct wl_surface *surface, Scale const *scale, pixman_region32_t *opaque)
+{
+	struct wl_region *region;
+	pixman_box32_t *box;
+	int32_t x1, x2, y1, y2;
+	int n;
+
+	if (!pixman_region32_not_empty(opaque)) {
+		wl_surface_set_opaque_region(surface, NULL);
+		return;
+	}
+
+	/* rounded inwards, the compositor must not take anything translucent
+	 * for opaque */
+	region = wl_compositor_create_region(compositor);
+	box = pixman_region32_rectangles(opaque, &n);
+	for (int i = 0; i < n; ++i, ++box) {
+		x1 = (box->x1 * 120 + scale->scale - 1) / scale->scale;
+		x2 = box->x2 * 120 / scale->scale;
+		y1 = (box->y1 * 120 + scale->scale - 1) / scale->scale;
+		y2 = box->y2 * 120 / scale->scale;
+		if (x1 < x2 && y1 < y2)
+			wl_region_add(region, x1, y1, x2 - x1, y2 - y1);
+	}
+	wl_surface_set_opaque_region(surface, region);
+	wl_region_destroy(region);
+}
+
 void
 shell_command(char const* command)
 {
-	if (fork() == 0) {
-		setsid();
-		execl("/bin/sh", "sh", "-c", command, NULL);
-		exit(EXIT_SUCCESS);
+	extern char **environ;
+	char *argv[] = { "sh", "-c", (char *)command, NULL };
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	struct timespec now;
+	Launch *launch, *tmp, *found = NULL;
+	pid_t pid;
+	int pidfd;
+
+	/* Skip commands run again within command_interval, and forget the
+	 * ones that have been quiet for longer */
+	if (command_interval) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wl_list_for_each_safe(launch, tmp, &launches, link) {
+			const uint64_t ms = (now.tv_sec - launch->last.tv_sec) * 1000
+				+ (now.tv_nsec - launch->last.tv_nsec) / 1000000;
+			if (ms < command_interval) {
+				if (!strcmp(launch->command, command))
+					found = launch;
+				continue;
+			}
+			wl_list_remove(&launch->link);
+			free(launch->command);
+			free(launch);
+		}
+		if (found)
+			return;
+		if ((launch = malloc(sizeof *launch)) && (launch->command = strdup(command))) {
+			launch->last = now;
+			wl_list_insert(&launches, &launch->link);
+		} else {
+			free(launch);
+		}
+	}
+
+	/* posix_spawn shares the address space until the exec, so the cost
+	 * of starting a command does not grow with the mappings and glyph
+	 * caches of the bar. The command gets a session of its own and the
+	 * signal dispositions of a fresh process. */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	errno = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (errno) {
+		fprintf(stderr, "posix_spawn: %s\n", strerror(errno));
+		return;
 	}
+	if (!reap_pidfds)
+		return;
+
+	/* the child is reaped by the event loop once its pidfd turns readable,
+	 * or along with the next one that does */
+	if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1)
+		return;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT(EventChild, pidfd) };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1)
+		die("epoll_ctl:");
 }
 
 void
@@ -1432,12 +3619,20 @@ show_bar(Bar *bar)
 		die("Could not create layer_surface");
 	zwlr_layer_surface_v1_add_listener(bar->layer_surface, &layer_surface_listener, bar);
 
-	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, bar->height / buffer_scale);
+	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, bar->scale->logical_height);
 	zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
 					 (bar->bottom ? ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM : ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP)
 					 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
 					 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, bar->height / buffer_scale);
+	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, bar->scale->logical_height);
+	setup_content(bar);
+	if (fractional_scale_manager && viewporter) {
+		bar->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+				fractional_scale_manager, bar->wl_surface);
+		wp_fractional_scale_v1_add_listener(bar->fractional_scale, &fractional_scale_listener, bar);
+		bar->viewport = wp_viewporter_get_viewport(viewporter, bar->content ? bar->content : bar->wl_surface);
+	}
+	setup_widgets(bar);
 	wl_surface_commit(bar->wl_surface);
 
 	bar->hidden = false;
@@ -1481,60 +3676,67 @@ stats_init(void)
 	localtime_r(&t, &stats.tm);
 
 	/* cpu */
-	stats.proc_stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC, 0);
-	if (stats.proc_stat_fd == -1)
+	stats.sources[SourceProcStat].fd = open("/proc/stat", O_RDONLY | O_CLOEXEC, 0);
+	if (stats.sources[SourceProcStat].fd == -1)
 		die("failed to open /proc/stat:");
+	stats.sources[SourceProcStat].offset = 5;
 	stats.cpu_usage = 0;
 	stats.cpu_prev_idle = 0;
 	stats.cpu_prev_total = 0;
 
 	/* memory */
-	stats.proc_meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC, 0);
-	if (stats.proc_meminfo_fd == -1)
+	stats.sources[SourceProcMeminfo].fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC, 0);
+	if (stats.sources[SourceProcMeminfo].fd == -1)
 		die("failed to open /proc/meminfo:");
+	stats.sources[SourceProcMeminfo].offset = 10;
 	stats.mem_usage = 0;
 
 	/* GPU temperature */
 	if (!(dir = opendir("/sys/class/hwmon/")))
 		die("Could not open directory /sys/class/hwmon/:");
 	struct dirent *de;
-	stats.gpu_hwmon_fd = -1;
+	stats.sources[SourceGpuHwmon].fd = -1;
 	while ((de = readdir(dir))) {
-		snprintf(sockbuf, 256, "/sys/class/hwmon/%s/name", de->d_name);
-		fd1 = open(sockbuf, O_RDONLY, 0);
+		snprintf(textbuf, 256, "/sys/class/hwmon/%s/name", de->d_name);
+		fd1 = open(textbuf, O_RDONLY, 0);
 		if (fd1 == -1)
 			continue;
-		read(fd1, sockbuf, 256);
-		if (!strncmp(sockbuf, "amdgpu", 6)) {
-			snprintf(sockbuf, 256, "/sys/class/hwmon/%s/temp1_input", de->d_name);
-			fd2 = open(sockbuf, O_RDONLY | O_CLOEXEC, 0);
+		read(fd1, textbuf, 256);
+		if (!strncmp(textbuf, "amdgpu", 6)) {
+			snprintf(textbuf, 256, "/sys/class/hwmon/%s/temp1_input", de->d_name);
+			fd2 = open(textbuf, O_RDONLY | O_CLOEXEC, 0);
 			if (fd2 != -1) {
-				stats.gpu_hwmon_fd = fd2;
+				stats.sources[SourceGpuHwmon].fd = fd2;
+				close(fd1);
 				break;
 			}
 		}
 		close(fd1);
 	}
 	closedir(dir);
-	if (stats.gpu_hwmon_fd == -1)
+	if (stats.sources[SourceGpuHwmon].fd == -1)
 		die("failed to find amdgpu hwmon");
 	stats.gpu_temperature = 0;
 
 	/* disk */
+	stats.sources[SourceProcDiskstats].fd = open("/proc/diskstats", O_RDONLY | O_CLOEXEC, 0);
+	if (stats.sources[SourceProcDiskstats].fd == -1)
+		die("failed to open /proc/diskstats:");
+	stats.disk_count = 0;
 	stats.prev_sectors_read = 0;
 	stats.prev_sectors_written = 0;
 	stats.cur_sectors_read = 0;
 	stats.cur_sectors_written = 0;
 
 	/* network */
-	stats.net_rx_bytes_fd =
+	stats.sources[SourceNetRx].fd =
 		open("/sys/class/net/" NET_INTERFACE_NAME "/statistics/rx_bytes", O_RDONLY | O_CLOEXEC, 0);
-	if (stats.net_rx_bytes_fd == -1)
+	if (stats.sources[SourceNetRx].fd == -1)
 		die("failed to open" "/sys/class/net/" NET_INTERFACE_NAME "/statistics/rx_bytes:");
 
-	stats.net_tx_bytes_fd =
+	stats.sources[SourceNetTx].fd =
 		open("/sys/class/net/" NET_INTERFACE_NAME "/statistics/tx_bytes", O_RDONLY | O_CLOEXEC, 0);
-	if (stats.net_tx_bytes_fd == -1)
+	if (stats.sources[SourceNetTx].fd == -1)
 		die("failed to open" "/sys/class/net/" NET_INTERFACE_NAME "/statistics/tx_bytes:");
 
 	stats.prev_rx_bytes = 0;
@@ -1542,58 +3744,320 @@ stats_init(void)
 	stats.cur_rx_bytes = 0;
 	stats.cur_tx_bytes = 0;
 
+	/* /proc/diskstats gets a large buffer, everything else fits in 256
+	 * bytes */
+	char *buf = stats.source_buf;
+	for (int i = 0; i < SourceCount; ++i) {
+		if (i == SourceProcDiskstats) {
+			stats.sources[i].size = 8192;
+			if (!(stats.sources[i].buf = malloc(stats.sources[i].size)))
+				die("malloc:");
+			continue;
+		}
+		stats.sources[i].buf = buf;
+		stats.sources[i].size = 256;
+		buf += stats.sources[i].size;
+	}
+
+#ifdef HAVE_LIBURING
+	/* Register the files and buffers once, so that every tick is a single
+	 * submission without per-read file or page lookups. Any failure here
+	 * just means falling back to pread. */
+	int fds[SourceCount];
+	for (int i = 0; i < SourceCount; ++i)
+		fds[i] = stats.sources[i].fd;
+	const struct iovec iov[] = {
+		{ stats.source_buf, sizeof stats.source_buf },
+		{ stats.sources[SourceProcDiskstats].buf, stats.sources[SourceProcDiskstats].size },
+	};
+	if (!io_uring_queue_init(SourceCount, &stats.ring, 0)) {
+		stats.use_ring = !io_uring_register_files(&stats.ring, fds, SourceCount)
+			&& !io_uring_register_buffers(&stats.ring, iov, LENGTH(iov));
+		if (!stats.use_ring)
+			io_uring_queue_exit(&stats.ring);
+	}
+#endif
+
+	/* samplers, all due on the first tick */
+	stats.samplers[SamplerCpu] = (Sampler){ .period = MAX(cpu_period, 1), .sources = 1 << SourceProcStat, .update = stats_update_cpu };
+	stats.samplers[SamplerMem] = (Sampler){ .period = MAX(mem_period, 1), .sources = 1 << SourceProcMeminfo, .update = stats_update_mem };
+	stats.samplers[SamplerDisk] = (Sampler){ .period = MAX(disk_period, 1), .sources = 1 << SourceProcDiskstats, .update = stats_update_disk };
+	stats.samplers[SamplerGpu] = (Sampler){ .period = MAX(gpu_period, 1), .sources = 1 << SourceGpuHwmon, .update = stats_update_gpu_temp };
+	stats.samplers[SamplerNet] = (Sampler){ .period = MAX(net_period, 1), .sources = 1 << SourceNetRx | 1 << SourceNetTx, .update = stats_update_network };
+
 	/* ALSA */
 	alsa_init();
 
-	/* precalculated sizes */
-	snprintf(sockbuf, 256, bar_time_fmt, '0', '0', '0');
-	draw_widths.time = text_width(sockbuf, 0xFFFFFFFFu, textpadding / 2);
-	snprintf(sockbuf, 256, bar_date_fmt, '0', '0', '0');
-	draw_widths.date = text_width(sockbuf, 0xFFFFFFFFu, textpadding / 2);
-	snprintf(sockbuf, 256, bar_state_fmt, "0", "0", "0", "0", '0', '0', '0');
-	draw_widths.state =  text_width(sockbuf, 0xFFFFFFFFu, textpadding);
-	draw_widths.tag =    text_width("0",     0xFFFFFFFFu, textpadding);
-	draw_widths.layout = text_width("000",   0xFFFFFFFFu, textpadding);
-	snprintf(sockbuf, 256, bar_alsa_fmt, 0, 0);
-	draw_widths.alsa = text_width(sockbuf, 0xFFFFFFFFu, textpadding / 2);
-	draw_widths.mic = text_width("100% ", 0xFFFFFFFFu, textpadding / 2);
+	/* hand the initial time over before any bar is drawn */
+	stats.back = 0;
+	stats.middle = 1;
+	stats.front = 2;
+	stats.slots[stats.back].tm = stats.tm;
+	stats_publish();
+	stats_consume();
+
+	/* collector thread */
+	if ((stats.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		die("eventfd:");
+	if ((stats.timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC)) == -1)
+		die("timerfd_create:");
+	pthread_mutex_init(&stats.timer_lock, NULL);
+	stats_timer_arm(true);
+	if ((errno = pthread_create(&stats.thread, NULL, stats_thread, NULL)))
+		die("pthread_create:");
+}
+
+bool
+stats_consume(void)
+{
+	if (!(atomic_load_explicit(&stats.middle, memory_order_relaxed) & SNAPSHOT_FRESH))
+		return false;
+	stats.front = atomic_exchange_explicit(&stats.middle, stats.front, memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+	return true;
 }
 
 void
-stats_update(void)
+stats_grow_source(int i)
 {
-	Bar* bar;
-	time_t t;
+	Source *src = &stats.sources[i];
+
+	src->size *= 2;
+	if (!(src->buf = realloc(src->buf, src->size)))
+		die("realloc:");
+
+#ifdef HAVE_LIBURING
+	/* the ring only reads into the buffers it knows about */
+	if (stats.use_ring) {
+		const struct iovec iov[] = {
+			{ stats.source_buf, sizeof stats.source_buf },
+			{ stats.sources[SourceProcDiskstats].buf, stats.sources[SourceProcDiskstats].size },
+		};
+		io_uring_unregister_buffers(&stats.ring);
+		if (io_uring_register_buffers(&stats.ring, iov, LENGTH(iov))) {
+			io_uring_queue_exit(&stats.ring);
+			stats.use_ring = false;
+		}
+	}
+#endif
+}
 
-	t = time(NULL);
-	localtime_r(&t, &stats.tm);
+void
+stats_handle_update(void)
+{
+	Bar *bar;
+	eventfd_t count;
 
-	stats_update_cpu();
-	stats_update_disk();
-	stats_update_gpu_temp();
-	stats_update_mem();
-	stats_update_network();
+	eventfd_read(stats.event_fd, &count);
+	if (!stats_consume())
+		return;
 
+	tile_update(true, false);
 	wl_list_for_each(bar, &bar_list, link) {
-		draw_stats(bar);
+		if (bar_shares_tile(bar))
+			continue;
+		bar->redraw_stats = true;
 		bar->redraw = true;
 	}
 }
 
+void
+stats_publish(void)
+{
+	stats.back = atomic_exchange_explicit(&stats.middle, stats.back | SNAPSHOT_FRESH, memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+}
+
+void
+stats_sample(uint32_t sources)
+{
+	Source *src;
+
+#ifdef HAVE_LIBURING
+	if (stats.use_ring) {
+		struct io_uring_sqe *sqe;
+		struct io_uring_cqe *cqe;
+		unsigned int count = 0;
+
+		for (int i = 0; i < SourceCount; ++i) {
+			if (!(sources & 1 << i))
+				continue;
+			src = &stats.sources[i];
+			sqe = io_uring_get_sqe(&stats.ring);
+			io_uring_prep_read_fixed(sqe, i, src->buf, src->size - 1, src->offset,
+					i == SourceProcDiskstats);
+			sqe->flags |= IOSQE_FIXED_FILE;
+			io_uring_sqe_set_data64(sqe, i);
+			++count;
+		}
+		if (io_uring_submit_and_wait(&stats.ring, count) < 0)
+			die("io_uring_submit_and_wait:");
+
+		for (unsigned int i = 0; i < count; ++i) {
+			if (io_uring_wait_cqe(&stats.ring, &cqe))
+				die("io_uring_wait_cqe:");
+			src = &stats.sources[io_uring_cqe_get_data64(cqe)];
+			src->len = cqe->res < 0 ? -1 : cqe->res;
+			io_uring_cqe_seen(&stats.ring, cqe);
+		}
+	} else
+#endif
+	for (int i = 0; i < SourceCount; ++i) {
+		if (!(sources & 1 << i))
+			continue;
+		src = &stats.sources[i];
+		src->len = pread(src->fd, src->buf, src->size - 1, src->offset);
+	}
+
+	for (int i = 0; i < SourceCount; ++i) {
+		if (!(sources & 1 << i))
+			continue;
+		src = &stats.sources[i];
+		src->buf[src->len > 0 ? src->len : 0] = '\0';
+	}
+}
+
+void *
+stats_thread(void *data)
+{
+	uint64_t expirations;
+	sigset_t mask;
+
+	/* leave signal handling to the main thread, which owns the poll loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	for (;;) {
+		if (read(stats.timer_fd, &expirations, sizeof expirations) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ECANCELED)
+				die("read timerfd:");
+			/* The clock was set, which leaves the timer off the second
+			 * boundaries or far in the future. Start over from now,
+			 * and do not take the jump for elapsed time. */
+			pthread_mutex_lock(&stats.timer_lock);
+			if (stats.timer_armed)
+				stats_timer_set();
+			pthread_mutex_unlock(&stats.timer_lock);
+			atomic_store_explicit(&stats.resumed, true, memory_order_relaxed);
+			continue;
+		}
+		/* missed ticks, e.g. across a suspend, are not worth catching up
+		 * on one by one */
+		if (expirations > 1)
+			atomic_store_explicit(&stats.resumed, true, memory_order_relaxed);
+		stats_update();
+	}
+
+	return NULL;
+}
+
+void
+stats_timer_arm(bool armed)
+{
+	static const struct itimerspec off;
+
+	if (armed == stats.timer_armed)
+		return;
+	pthread_mutex_lock(&stats.timer_lock);
+	stats.timer_armed = armed;
+	if (armed) {
+		atomic_store_explicit(&stats.resumed, true, memory_order_relaxed);
+		stats_timer_set();
+	} else {
+		timerfd_settime(stats.timer_fd, 0, &off, NULL);
+	}
+	pthread_mutex_unlock(&stats.timer_lock);
+}
+
+void
+stats_timer_set(void)
+{
+	/* Tick on every whole second of the wall clock, starting with the one
+	 * that just passed, so that bars shown again catch up at once and the
+	 * clock turns over together with the seconds. Every sampler period is
+	 * a multiple of this, so there is never more than one wakeup a
+	 * second. */
+	struct itimerspec spec = { .it_interval = { 1, 0 } };
+
+	clock_gettime(CLOCK_REALTIME, &spec.it_value);
+	spec.it_value.tv_nsec = 0;
+	timerfd_settime(stats.timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+}
+
+void
+stats_update(void)
+{
+	Snapshot *snap = &stats.slots[stats.back];
+	Sampler *s;
+	struct timespec now;
+	uint32_t due = 0, sources = 0;
+	bool resumed;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	localtime_r(&now.tv_sec, &stats.tm);
+	resumed = atomic_exchange_explicit(&stats.resumed, false, memory_order_relaxed);
+
+	/* A sampler is due whenever its period rolls over, which keeps all of
+	 * them on the same seconds. Everything is due after a pause. */
+	for (int i = 0; i < SamplerCount; ++i) {
+		s = &stats.samplers[i];
+		if (resumed || now.tv_sec / s->period != s->last / s->period) {
+			due |= 1 << i;
+			sources |= s->sources;
+		}
+	}
+
+	stats_sample(sources);
+	for (int i = 0; i < SamplerCount; ++i) {
+		if (!(due & 1 << i))
+			continue;
+		s = &stats.samplers[i];
+		/* rates over however long the timer was off are not per second */
+		s->elapsed = resumed || !s->last ? 0 : now.tv_sec - s->last;
+		s->last = now.tv_sec;
+		s->update();
+	}
+
+	s = &stats.samplers[SamplerDisk];
+	if (due & 1 << SamplerDisk) {
+		stats.disk_read = s->elapsed ? (stats.cur_sectors_read - stats.prev_sectors_read) * 512 / s->elapsed : 0;
+		stats.disk_written = s->elapsed ? (stats.cur_sectors_written - stats.prev_sectors_written) * 512 / s->elapsed : 0;
+	}
+	s = &stats.samplers[SamplerNet];
+	if (due & 1 << SamplerNet) {
+		stats.net_rx = s->elapsed ? (stats.cur_rx_bytes - stats.prev_rx_bytes) / s->elapsed : 0;
+		stats.net_tx = s->elapsed ? (stats.cur_tx_bytes - stats.prev_tx_bytes) / s->elapsed : 0;
+	}
+
+	snap->tm = stats.tm;
+	snap->cpu_usage = stats.cpu_usage;
+	snap->mem_usage = stats.mem_usage;
+	snap->gpu_temperature = stats.gpu_temperature;
+	snap->disk_read = stats.disk_read;
+	snap->disk_written = stats.disk_written;
+	snap->net_rx = stats.net_rx;
+	snap->net_tx = stats.net_tx;
+	stats_publish();
+
+	eventfd_write(stats.event_fd, 1);
+}
+
 void
 stats_update_cpu(void)
 {
-	lseek(stats.proc_stat_fd, 5, SEEK_SET);
-	read(stats.proc_stat_fd, sockbuf, 128);
+	char const *buf = stats.sources[SourceProcStat].buf;
+
+	if (stats.sources[SourceProcStat].len <= 0)
+		return;
 
 	ssize_t j = 0;
 	uint32_t total = 0;
 	uint32_t idle = 0;
 	for (ssize_t i = 0; i < 3; ++i) {
 		unsigned int x = 0;
-		while (sockbuf[j] != ' ') {
+		while (buf[j] != ' ') {
 			x *= 10;
-			x += sockbuf[j] - '0';
+			x += buf[j] - '0';
 			++j;
 		}
 		total += x;
@@ -1602,9 +4066,9 @@ stats_update_cpu(void)
 
 	for (ssize_t i = 0; i < 2; ++i) {
 		unsigned int x = 0;
-		while (sockbuf[j] != ' ') {
+		while (buf[j] != ' ') {
 			x *= 10;
-			x += sockbuf[j] - '0';
+			x += buf[j] - '0';
 			++j;
 		}
 		total += x;
@@ -1614,9 +4078,9 @@ stats_update_cpu(void)
 
 	for (ssize_t i = 0; i < 3; ++i) {
 		unsigned int x = 0;
-		while (sockbuf[j] != ' ') {
+		while (buf[j] != ' ') {
 			x *= 10;
-			x += sockbuf[j] - '0';
+			x += buf[j] - '0';
 			++j;
 		}
 		total += x;
@@ -1634,22 +4098,61 @@ stats_update_cpu(void)
 void
 stats_update_disk(void)
 {
-	char const *cur;
-	int fd;
-	DIR *dir;
+	Source const *src = &stats.sources[SourceProcDiskstats];
+	char const *cur, *end, *name, *whole = NULL;
+	size_t len, whole_len = 0, i;
+	uint64_t sectors_read, sectors_written;
+	Disk *disk;
+
+	/* every device is in one file, so a single read covers them all, but
+	 * only look at complete rows */
+	if (src->len <= 0 || !(end = memrchr(src->buf, '\n', src->len)))
+		return;
 
+	/* The totals only ever grow by what each device did since the last
+	 * tick, so a device going away does not make them go backwards */
 	stats.prev_sectors_read = stats.cur_sectors_read;
 	stats.prev_sectors_written = stats.cur_sectors_written;
-	if (!(dir = opendir("/sys/block")))
-		die("Could not open directory /sys/block:");
-	struct dirent *de;
-	while ((de = readdir(dir))) {
-		snprintf(sockbuf, 256, "/sys/block/%s/stat", de->d_name);
-		fd = open(sockbuf, O_RDONLY, 0);
-		if (fd == -1)
+
+	/* A file that filled the buffer may have lost rows, which would then
+	 * look like devices that just appeared. Skip the tick, with a buffer
+	 * large enough for the next one, and start over from its counters. */
+	if ((size_t)src->len == src->size - 1) {
+		stats.disk_count = 0;
+		stats_grow_source(SourceProcDiskstats);
+		return;
+	}
+	i = 0;
+
+	for (cur = src->buf; cur < end; skip_line(&cur)) {
+		// major and minor number
+		skip_space(&cur);
+		skip_word(&cur);
+		skip_space(&cur);
+		skip_word(&cur);
+
+		skip_space(&cur);
+		name = cur;
+		skip_word(&cur);
+		len = cur - name;
+
+		/* Partitions directly follow their disk and are named after it
+		 * plus a number, optionally separated by a 'p'. They are
+		 * already accounted for in the disk itself. */
+		if (whole && len > whole_len && !strncmp(name, whole, whole_len)) {
+			char const *p = name + whole_len;
+			if (*p == 'p' && p + 1 < cur)
+				++p;
+			while (p < cur && *p >= '0' && *p <= '9')
+				++p;
+			if (p == cur)
+				continue;
+		}
+		whole = name;
+		whole_len = len;
+
+		if (!disk_selected(name, len))
 			continue;
-		read(fd, sockbuf, 256);
-		cur = sockbuf;
 
 		// completed reads
 		skip_space(&cur);
@@ -1661,7 +4164,7 @@ stats_update_disk(void)
 
 		// sectors reads
 		skip_space(&cur);
-		stats.cur_sectors_read = parse_trusted_uint64_t(&cur);
+		sectors_read = parse_trusted_uint64_t(&cur);
 
 		// milliseconds spent reading
 		skip_space(&cur);
@@ -1677,11 +4180,33 @@ stats_update_disk(void)
 
 		// sectors writes
 		skip_space(&cur);
-		stats.cur_sectors_written = parse_trusted_uint64_t(&cur);
-
-		close(fd);
+		sectors_written = parse_trusted_uint64_t(&cur);
+
+		if (i < LENGTH(stats.disks)) {
+			disk = &stats.disks[i++];
+			len = MIN(len, sizeof disk->name - 1);
+			/* a device that was not here on the last tick starts from
+			 * its current counters */
+			if (i > stats.disk_count || strncmp(disk->name, name, len) || disk->name[len]) {
+				memcpy(disk->name, name, len);
+				disk->name[len] = '\0';
+				disk->cur_sectors_read = sectors_read;
+				disk->cur_sectors_written = sectors_written;
+			}
+			disk->prev_sectors_read = disk->cur_sectors_read;
+			disk->prev_sectors_written = disk->cur_sectors_written;
+			disk->cur_sectors_read = sectors_read;
+			disk->cur_sectors_written = sectors_written;
+
+			/* counters only go down when a device was replaced by
+			 * another of the same name */
+			if (disk->cur_sectors_read >= disk->prev_sectors_read)
+				stats.cur_sectors_read += disk->cur_sectors_read - disk->prev_sectors_read;
+			if (disk->cur_sectors_written >= disk->prev_sectors_written)
+				stats.cur_sectors_written += disk->cur_sectors_written - disk->prev_sectors_written;
+		}
 	}
-	closedir(dir);
+	stats.disk_count = i;
 }
 
 void
@@ -1689,9 +4214,9 @@ stats_update_gpu_temp(void)
 {
 	char const *cur;
 	uint64_t file_read;
-	lseek(stats.gpu_hwmon_fd, 0, SEEK_SET);
-	read(stats.gpu_hwmon_fd, sockbuf, 128);
-	cur = sockbuf;
+	if (stats.sources[SourceGpuHwmon].len <= 0)
+		return;
+	cur = stats.sources[SourceGpuHwmon].buf;
 	file_read = parse_trusted_uint64_t(&cur);
 	stats.gpu_temperature = file_read / 1000;
 }
@@ -1702,10 +4227,9 @@ stats_update_mem(void)
 	char const *cur;
 	uint64_t total, available;
 
-	lseek(stats.proc_meminfo_fd, 10, SEEK_SET);
-	read(stats.proc_meminfo_fd, sockbuf, 128);
-
-	cur = sockbuf;
+	if (stats.sources[SourceProcMeminfo].len <= 0)
+		return;
+	cur = stats.sources[SourceProcMeminfo].buf;
 
 	skip_space(&cur);
 	total  = parse_trusted_uint64_t(&cur);
@@ -1726,15 +4250,283 @@ stats_update_network(void)
 	stats.prev_rx_bytes = stats.cur_rx_bytes;
 	stats.prev_tx_bytes = stats.cur_tx_bytes;
 
-	lseek(stats.net_rx_bytes_fd, 0, SEEK_SET);
-	read(stats.net_rx_bytes_fd, sockbuf, 128);
-	cur = sockbuf;
-	stats.cur_rx_bytes = parse_trusted_uint64_t(&cur);
+	if (stats.sources[SourceNetRx].len > 0) {
+		cur = stats.sources[SourceNetRx].buf;
+		stats.cur_rx_bytes = parse_trusted_uint64_t(&cur);
+	}
+
+	if (stats.sources[SourceNetTx].len > 0) {
+		cur = stats.sources[SourceNetTx].buf;
+		stats.cur_tx_bytes = parse_trusted_uint64_t(&cur);
+	}
+}
+
+bool
+status_click(Status const *status, uint32_t x, uint32_t button)
+{
+	StatusButton const *b;
+	StatusRun const *first, *last;
+
+	if (!status->drawn)
+		return false;
+
+	for (uint32_t i = 0; i < status->button_count; ++i) {
+		b = &status->buttons[i];
+		if (b->button != button || b->first >= b->last)
+			continue;
+		first = &status->runs[b->first];
+		last = &status->runs[b->last - 1];
+		if (x >= status->x + first->x && x < status->x + last->x + last->advance) {
+			shell_command(status->text + b->command);
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+status_clear(Status *status)
+{
+	free(status->markup);
+	free(status->text);
+	free(status->runs);
+	free(status->buttons);
+	*status = (Status){ 0 };
+}
+
+void
+status_layout(Status *status, uint32_t limit)
+{
+	GlyphRun const *glyphs;
+	StatusRun *run;
+	uint32_t x = 0;
+
+	/* only a new status, font or width of the bar needs a new layout */
+	if (status->font == font && status->limit == limit)
+		return;
+	status->font = font;
+	status->limit = limit;
+
+	for (uint32_t i = 0; i < status->run_count; ++i) {
+		run = &status->runs[i];
+		run->x = x;
+		run->limit = limit - x;
+		glyphs = glyph_run_get(&text_runs, status->text + run->text, run->limit);
+		run->advance = glyphs->count ? glyphs->advance : 0;
+		x += run->advance;
+	}
+	status->advance = x;
+}
+
+void
+status_parse(Status *status, char const *markup)
+{
+	static const struct {
+		char name[3];
+		uint32_t button;
+	} regions[] = {
+		{ "lm", BTN_LEFT },
+		{ "mm", BTN_MIDDLE },
+		{ "rm", BTN_RIGHT },
+		{ "us", StatusScrollUp },
+		{ "ds", StatusScrollDown },
+	};
+	const size_t len = strlen(markup);
+	/* the button of every region begun and not yet terminated */
+	int32_t open[LENGTH(regions)];
+	StatusRun cur = { 0 };
+	char const *p, *name, *arg, *end;
+	size_t t = 0, i;
+
+	/* The text of the runs, the commands and their terminators together
+	 * never take more than twice the markup */
+	if (!(status->text = realloc(status->text, 2 * len + 2)))
+		die("realloc:");
+	status->run_count = 0;
+	status->button_count = 0;
+	status->translucent = false;
+	status->font = NULL;
+	status->drawn = false;
+	for (i = 0; i < LENGTH(open); ++i)
+		open[i] = -1;
+
+	for (p = markup;;) {
+		if (*p && (*p != '^' || !status_commands)) {
+			status->text[t++] = *p++;
+			continue;
+		}
+		if (*p && p[1] == '^') {
+			status->text[t++] = '^';
+			p += 2;
+			continue;
+		}
+		if (*p && (!p[1] || !p[2] || p[3] != '(' || !(end = strchr(p + 4, ')')))) {
+			status->text[t++] = *p++;
+			continue;
+		}
+
+		/* Every in-line command and the end of the markup finish the
+		 * run so far, dropping it if it is empty */
+		if (t > cur.text) {
+			status->text[t++] = '\0';
+			if (status->run_count == status->run_size) {
+				status->run_size = MAX(8, status->run_size * 2);
+				if (!(status->runs = realloc(status->runs, status->run_size * sizeof *status->runs)))
+					die("realloc:");
+			}
+			status->runs[status->run_count++] = cur;
+		}
+		if (!*p)
+			break;
+		name = p + 1;
+		arg = p + 4;
+		p = end + 1;
+
+		if (!strncmp(name, "fg", 2)) {
+			cur.has_fg = parse_color(arg, end, &cur.fg);
+		} else if (!strncmp(name, "bg", 2)) {
+			cur.has_bg = parse_color(arg, end, &cur.bg);
+			status->translucent |= cur.has_bg && cur.bg.alpha != 0xffff;
+		} else {
+			for (i = 0; i < LENGTH(regions) && strncmp(name, regions[i].name, 2); ++i)
+				;
+			if (i == LENGTH(regions))
+				goto next;
+
+			/* a region command terminates the open region of its
+			 * kind, and begins a new one when it has a command */
+			if (open[i] != -1) {
+				status->buttons[open[i]].last = status->run_count;
+				open[i] = -1;
+			}
+			if (arg == end)
+				goto next;
+			if (status->button_count == status->button_size) {
+				status->button_size = MAX(4, status->button_size * 2);
+				if (!(status->buttons = realloc(status->buttons, status->button_size * sizeof *status->buttons)))
+					die("realloc:");
+			}
+			status->buttons[status->button_count] = (StatusButton){
+				.button = regions[i].button,
+				.command = t,
+				.first = status->run_count,
+			};
+			open[i] = status->button_count++;
+			memcpy(status->text + t, arg, end - arg);
+			t += end - arg;
+			status->text[t++] = '\0';
+		}
+next:
+		cur.text = t;
+	}
+
+	/* regions left open run to the end */
+	for (i = 0; i < LENGTH(open); ++i)
+		if (open[i] != -1)
+			status->buttons[open[i]].last = status->run_count;
+}
+
+void
+status_set(Bar *bar, Status *status, char const *markup)
+{
+	Bar *it;
+
+	/* producers tend to send the same text over and over */
+	if (status->markup && !strcmp(status->markup, markup))
+		return;
+	free(status->markup);
+	if (!(status->markup = strdup(markup)))
+		die("strdup:");
+
+	status_parse(status, markup);
+	bar->redraw_window = true;
+	bar->redraw = true;
+
+	/* Buffers chosen without alpha for opaque colors would lose that of a
+	 * translucent ^bg(), so from now on every bar gets buffers with it */
+	if (status->translucent && shm_format == WL_SHM_FORMAT_XRGB8888) {
+		shm_format = WL_SHM_FORMAT_ARGB8888;
+		wl_list_for_each(it, &bar_list, link) {
+			bar_destroy_buffers(it);
+			bar_redraw_all(it);
+		}
+	}
+}
+
+void
+subscriber_add(Client *client, char const *output)
+{
+	Bar *bar;
+
+	client->subscribed = true;
+	snprintf(client->output, sizeof client->output, "%s", output);
+
+	/* start off with where every bar is at */
+	wl_list_for_each(bar, &bar_list, link)
+		if (strcmp(output, "selected") || bar->sel)
+			subscriber_event(client, bar, ChangedAll);
+}
+
+void
+subscriber_event(Client *client, Bar const *bar, uint32_t changed)
+{
+	char line[512];
+	size_t len;
+	char *c;
+
+	if (!bar->xdg_output_name)
+		return;
+	if (!strcmp(client->output, "selected")) {
+		/* Follow the selection, in full for the bar that just got
+		 * it, and only as far as losing it for the one it left */
+		if (bar->sel && changed & ChangedSel)
+			changed = ChangedAll;
+		else if (!bar->sel && changed & ChangedSel)
+			changed = ChangedSel;
+		else if (!bar->sel)
+			return;
+	} else if (strcmp(client->output, "all") && strcmp(client->output, bar->xdg_output_name)) {
+		return;
+	}
+
+	/* behind already, so this is covered by the full state sent once the
+	 * ring drains */
+	if (client->lag) {
+		++client->lag;
+		return;
+	}
+
+	/* One line per frame, holding only what changed. The title goes last
+	 * and runs to the end of the line. */
+	len = snprintf(line, sizeof line, "%s", bar->xdg_output_name);
+	if (changed & ChangedTags)
+		len += snprintf(line + len, sizeof line - len, " tags %u %u %u", bar->mtags, bar->ctags, bar->urg);
+	if (changed & ChangedSel)
+		len += snprintf(line + len, sizeof line - len, " sel %u", bar->sel);
+	if (changed & ChangedLayout)
+		len += snprintf(line + len, sizeof line - len, " layout %u", bar->layout_idx);
+	if (changed & ChangedTitle) {
+		len += snprintf(line + len, sizeof line - len, " title %s", bar->window_title ? bar->window_title : "");
+		len = MIN(len, sizeof line - 2);
+		for (c = line; (c = memchr(c, '\n', line + len - c)); )
+			*c = ' ';
+	}
+	line[len++] = '\n';
+
+	if (!client_queue(client, line, len))
+		client->lag = 1;
+}
+
+Color const *
+tag_color(Bar const *bar, uint32_t tag)
+{
+	const bool active   = bar->mtags & 1 << tag;
+	const bool occupied = bar->ctags & 1 << tag;
+	const bool urgent   = bar->urg   & 1 << tag;
 
-	lseek(stats.net_tx_bytes_fd, 0, SEEK_SET);
-	read(stats.net_tx_bytes_fd, sockbuf, 128);
-	cur = sockbuf;
-	stats.cur_tx_bytes = parse_trusted_uint64_t(&cur);
+	if (hide_vacant && !active && !occupied && !urgent)
+		return bar->sel ? &middle_sel_color : &middle_color;
+	return urgent ? &urgent_color : (active ? &active_color : (occupied ? &occupied_color : &inactive_color));
 }
 
 void
@@ -1742,13 +4534,27 @@ teardown_bar(Bar *bar)
 {
 	if (bar->window_title)
 		free(bar->window_title);
+	status_clear(&bar->status);
+	status_clear(&bar->title);
 	zdwl_ipc_output_v2_destroy(bar->dwl_wm_output);
 	if (bar->xdg_output_name)
 		free(bar->xdg_output_name);
+	if (bar->frame_callback)
+		wl_callback_destroy(bar->frame_callback);
 	if (!bar->hidden) {
+		teardown_widgets(bar);
+		if (bar->viewport)
+			wp_viewport_destroy(bar->viewport);
+		if (bar->fractional_scale)
+			wp_fractional_scale_v1_destroy(bar->fractional_scale);
+		teardown_content(bar);
 		zwlr_layer_surface_v1_destroy(bar->layer_surface);
 		wl_surface_destroy(bar->wl_surface);
 	}
+	bar_destroy_buffers(bar);
+	pixman_region32_fini(&bar->damage);
+	pixman_region32_fini(&bar->shared);
+	pixman_region32_fini(&bar->opaque);
 	if (bar->shm_fd >= 0) {
 		close(bar->shm_fd);
 	}
@@ -1757,6 +4563,107 @@ teardown_bar(Bar *bar)
 	free(bar);
 }
 
+void
+tile_flush(void)
+{
+	Bar *bar, *widget;
+	pixman_region32_t part;
+	const uint32_t date_x = tile->width - draw_widths.date;
+
+	/* Whatever changed in the tile goes to every bar showing it. Bars that
+	 * are hidden or not configured yet get all of it once configured. */
+	if (!pixman_region32_not_empty(&tile->damage))
+		return;
+	pixman_region32_init(&part);
+	wl_list_for_each(bar, &bar_list, link) {
+		if (bar->hidden || &bar->scale->tile != tile || !bar_shares_tile(bar))
+			continue;
+		if (!bar->widgets[0]) {
+			pixman_region32_union(&bar->shared, &bar->shared, &tile->damage);
+			bar->redraw = true;
+			continue;
+		}
+
+		/* with widgets, only a new date still needs a commit of the bar
+		 * itself */
+		for (int i = 0; i < WidgetCount; ++i) {
+			if (!(widget = bar->widgets[i]))
+				continue;
+			pixman_region32_intersect_rect(&part, &tile->damage,
+					widget->tile_x, 0, widget->width, widget->height);
+			if (pixman_region32_not_empty(&part)) {
+				pixman_region32_union(&widget->shared, &widget->shared, &part);
+				widget->redraw = true;
+			}
+		}
+		if (bar->widgets[WidgetDate])
+			continue;
+		pixman_region32_intersect_rect(&part, &tile->damage,
+				date_x, 0, tile->width - date_x, tile->height);
+		if (pixman_region32_not_empty(&part)) {
+			pixman_region32_union(&bar->shared, &bar->shared, &part);
+			bar->redraw = true;
+		}
+	}
+	pixman_region32_fini(&part);
+	pixman_region32_clear(&tile->damage);
+}
+
+void
+tile_update(bool stats, bool alsa)
+{
+	Scale *scale;
+
+	wl_list_for_each(scale, &scales, link) {
+		if (!scale->tile.canvas)
+			continue;
+		scale_use(scale);
+		if (alsa)  draw_alsa(tile);
+		if (stats) draw_stats(tile);
+		tile_flush();
+	}
+}
+
+void
+teardown_widgets(Bar *bar)
+{
+	Bar *widget;
+
+	for (int i = 0; i < WidgetCount; ++i) {
+		if (!(widget = bar->widgets[i]))
+			continue;
+		if (widget->frame_callback)
+			wl_callback_destroy(widget->frame_callback);
+		if (widget->viewport)
+			wp_viewport_destroy(widget->viewport);
+		wl_subsurface_destroy(widget->subsurface);
+		wl_surface_destroy(widget->wl_surface);
+		bar_destroy_buffers(widget);
+		pixman_region32_fini(&widget->damage);
+		pixman_region32_fini(&widget->shared);
+		pixman_region32_fini(&widget->opaque);
+		if (widget->shm_fd >= 0)
+			close(widget->shm_fd);
+		free(widget);
+		bar->widgets[i] = NULL;
+	}
+}
+
+void
+teardown_content(Bar *bar)
+{
+	if (!bar->content)
+		return;
+
+	wl_subsurface_destroy(bar->content_subsurface);
+	wl_surface_destroy(bar->content);
+	wp_viewport_destroy(bar->background_viewport);
+	bar->content = NULL;
+	bar->content_subsurface = NULL;
+	bar->background_viewport = NULL;
+	bar->background = NULL;
+}
+
 void
 teardown_seat(Seat *seat)
 {
@@ -1769,39 +4676,24 @@ teardown_seat(Seat *seat)
 uint32_t
 text_width(char const* text, uint32_t max_x, uint32_t padding)
 {
+	GlyphRun const *run;
+
 	if (!text || !*text || !max_x || ((padding * 2) >= max_x))
 		return 0;
 
-	uint32_t codepoint, x = padding, last_cp = 0, state = UTF8_ACCEPT;
-	for (char const *p = text; *p; p++) {
-		/* Returns nonzero if more bytes are needed */
-		if (utf8decode(&state, &codepoint, *p))
-			continue;
-
-		const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
-		if (!glyph)
-			continue;
-
-		long kern = 0;
-		if (last_cp)
-			fcft_kerning(font, last_cp, codepoint, &kern, NULL);
-		if ((x + kern + glyph->advance.x + padding) > max_x)
-			break;
-		x += kern + glyph->advance.x;
-		last_cp = codepoint;
-	}
-
-	if (!last_cp)
+	run = glyph_run_get(&text_runs, text, max_x - padding * 2);
+	if (!run->count)
 		return 0;
 
-	return x + padding;
+	return run->advance + padding * 2;
 }
 
 void
 wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
 	/* Sent by the compositor when it's no longer using this buffer */
-	wl_buffer_destroy(wl_buffer);
+	Buffer *buf = (Buffer *)data;
+	buf->busy = false;
 }
 
 int
@@ -1810,6 +4702,7 @@ main(int argc, char **argv)
 	char *xdgruntimedir, socketdir[256];
 	struct sockaddr_un sock_address;
 	Bar *bar, *bar2;
+	Client *client, *client2;
 	Seat *seat, *seat2;
 
 	if (argc > 1) {
@@ -1819,6 +4712,9 @@ main(int argc, char **argv)
 		} else if (!strcmp(argv[1], "-h")) {
 			printf(usage);
 			return 0;
+		} else if (!strcmp(argv[1], "-bench-render")) {
+			bench_render(argc - 2, argv + 2);
+			return 0;
 		} else {
 			die("Option '%s' not recognized\n%s", argv[1], usage);
 		}
@@ -1851,12 +4747,19 @@ main(int argc, char **argv)
 	fcft_init(FCFT_LOG_COLORIZE_AUTO, 0, FCFT_LOG_CLASS_ERROR);
 	fcft_set_scaling_filter(FCFT_SCALING_FILTER_LANCZOS3);
 
-	unsigned int dpi = 96 * buffer_scale;
-	snprintf(sockbuf, 256, "dpi=%u", dpi);
-	if (!(font = fcft_from_name(FONTCOUNT, fontstr, sockbuf)))
-		die("Could not load font");
-	textpadding = (font->height * 2) / 5;
-	height = font->height / buffer_scale + vertical_padding * 2;
+	/* Without any translucent background, the alpha channel is of no use
+	 * to the compositor */
+	if (time_color.bg.alpha == 0xffff && active_color.bg.alpha == 0xffff
+	    && occupied_color.bg.alpha == 0xffff && inactive_color.bg.alpha == 0xffff
+	    && urgent_color.bg.alpha == 0xffff && middle_color.bg.alpha == 0xffff
+	    && middle_sel_color.bg.alpha == 0xffff)
+		shm_format = WL_SHM_FORMAT_XRGB8888;
+
+	/* the flat background of every bar is a single pixel stretched over it */
+	if (flat_background && subcompositor && viewporter && single_pixel_buffer_manager) {
+		backgrounds[0] = create_single_pixel_buffer(&middle_color.bg);
+		backgrounds[1] = create_single_pixel_buffer(&middle_sel_color.bg);
+	}
 
 	/* Setup bars */
 	stats_init();
@@ -1886,6 +4789,8 @@ main(int argc, char **argv)
 	if (listen(sock_fd, SOMAXCONN) == -1)
 		die("listen:");
 	fcntl(sock_fd, F_SETFD, FD_CLOEXEC | fcntl(sock_fd, F_GETFD));
+	fcntl(sock_fd, F_SETFL, O_NONBLOCK | fcntl(sock_fd, F_GETFL));
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
 	/* Set up signals */
 	struct sigaction sa;
@@ -1895,20 +4800,55 @@ main(int argc, char **argv)
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
-	sa.sa_handler = SIG_IGN;
-	sigaction(SIGCHLD, &sa, NULL);
+
+	/* Commands are reaped through pidfds in the event loop. Where those
+	 * are missing, the kernel reaps them as SIGCHLD is ignored. */
+	int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+	if (pidfd != -1) {
+		reap_pidfds = true;
+		close(pidfd);
+	} else {
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGCHLD, &sa, NULL);
+	}
+
+	/* Set up the poll set, which lives as long as the event loop */
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		die("epoll_create1:");
+	const struct { int fd; uint32_t event; } watched[] = {
+		{ wl_display_get_fd(display), EventWayland },
+		{ sock_fd, EventSocket },
+		{ stats.event_fd, EventStats },
+	};
+	for (size_t i = 0; i < LENGTH(watched); ++i) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT(watched[i].event, 0) };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched[i].fd, &ev) == -1)
+			die("epoll_ctl:");
+	}
+	alsa_watch();
 
 	/* Run */
 	run_display = true;
 	event_loop();
 
 	/* Clean everything up */
+	pthread_cancel(stats.thread);
+	pthread_join(stats.thread, NULL);
+	close(stats.timer_fd);
+	close(stats.event_fd);
+	wl_list_for_each_safe(client, client2, &clients, link)
+		client_close(client);
 	close(sock_fd);
-	close(stats.proc_stat_fd);
-	close(stats.proc_meminfo_fd);
-	close(stats.gpu_hwmon_fd);
-	close(stats.net_rx_bytes_fd);
-	close(stats.net_tx_bytes_fd);
+	if (spare_fd != -1)
+		close(spare_fd);
+	close(epoll_fd);
+#ifdef HAVE_LIBURING
+	if (stats.use_ring)
+		io_uring_queue_exit(&stats.ring);
+#endif
+	for (int i = 0; i < SourceCount; ++i)
+		close(stats.sources[i].fd);
+	free(stats.sources[SourceProcDiskstats].buf);
 	snd_mixer_free(stats.mixer);
 
 	unlink(socketpath);
@@ -1922,10 +4862,23 @@ main(int argc, char **argv)
 	zxdg_output_manager_v1_destroy(output_manager);
 	zdwl_ipc_manager_v2_destroy(dwl_wm);
 
-	fcft_destroy(font);
+	cells_clear();
+	glyph_runs_clear();
+	scales_clear();
 	fcft_fini();
 
+	for (int i = 0; i < 2; ++i)
+		if (backgrounds[i])
+			wl_buffer_destroy(backgrounds[i]);
+	if (single_pixel_buffer_manager)
+		wp_single_pixel_buffer_manager_v1_destroy(single_pixel_buffer_manager);
+	if (fractional_scale_manager)
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+	if (viewporter)
+		wp_viewporter_destroy(viewporter);
 	wl_shm_destroy(shm);
+	if (subcompositor)
+		wl_subcompositor_destroy(subcompositor);
 	wl_compositor_destroy(compositor);
 	wl_registry_destroy(registry);
 	wl_display_disconnect(display);
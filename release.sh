@@ -2,4 +2,11 @@
 
 set -e
 
-CFLAGS="-O3 -march=native -pipe -flto=auto" make -j"$(nproc)"
+CFLAGS="-O3 -march=native -pipe -flto=auto"
+
+# Profile-guided build, trained on the offscreen render benchmark
+make clean
+CFLAGS="$CFLAGS -fprofile-generate" make -j"$(nproc)"
+./dwlb -bench-render >/dev/null
+make clean
+CFLAGS="$CFLAGS -fprofile-use -fprofile-correction" make -j"$(nproc)"